@@ -0,0 +1,27 @@
+#!/bin/sh
+# Run every benchmark script with each of the given viper executables.
+#
+# Usage: sh benchmark/run.sh <viper> [<viper> ...]
+#
+# e.g. compare computed goto against switch dispatch (both builds write
+# cmake/bin/viper, so copy each executable out after building):
+#   cmake -S cmake -B build-goto && cmake --build build-goto
+#   cp cmake/bin/viper viper-goto
+#   cmake -S cmake -B build-switch -DVIPER_COMPUTED_GOTO=OFF && cmake --build build-switch
+#   cp cmake/bin/viper viper-switch
+#   sh benchmark/run.sh ./viper-goto ./viper-switch
+
+if [ $# -eq 0 ]; then
+    echo "Usage: sh benchmark/run.sh <viper> [<viper> ...]"
+    exit 64
+fi
+
+DIR=$(dirname "$0")
+
+for script in "$DIR"/*.viper; do
+    echo "== $(basename "$script") =="
+    for viper in "$@"; do
+        printf "%-30s " "$viper"
+        "$viper" "$script" | grep "elapsed"
+    done
+done
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Compare full collection pauses with 1, 2, 4 and 8 GC threads on a large
+# heap. The pause target is raised so each collection runs in one pause.
+#
+# Usage: sh benchmark/threads.sh <viper>
+
+if [ $# -ne 1 ]; then
+    echo "Usage: sh benchmark/threads.sh <viper>"
+    exit 64
+fi
+
+DIR=$(dirname "$0")
+
+for threads in 1 2 4 8; do
+    printf "%-12s " "$threads threads"
+    "$1" --gc-threads "$threads" --gc-pause 10000 "$DIR/mark.viper" \
+        | grep "max pause"
+done
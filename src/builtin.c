@@ -3,7 +3,10 @@
 #include "builtin.h"
 #include "bytes.h"
 #include "file.h"
+#include "map.h"
+#include "memory.h"
 #include "object.h"
+#include "runtime.h"
 #include "value.h"
 #include "vm.h"
 
@@ -20,14 +23,62 @@ bool clockNative(int argCount, Value* args){
     return true;
 }
 
+// Longest pause of the garbage collector so far, in milliseconds
+bool gcMaxPauseNative(int argCount, Value* args){
+    if(argCount != 0){
+        args[-1] = errorOutput("Expected 0 arguments to gc_max_pause method.");
+        return false;
+    }
+    args[-1] = NUMBER_VAL(vm.gcMaxPause * 1000);
+    return true;
+}
+
+// Collects the garbage, the interpreter compacts what is left once the call
+// returns
+bool gcCompactNative(int argCount, Value* args){
+    if(argCount != 0){
+        args[-1] = errorOutput("Expected 0 arguments to gc_compact method.");
+        return false;
+    }
+    collectGarbage();
+    vm.compactPending = true;
+    args[-1] = NULL_VAL;
+    return true;
+}
+
+// Map of the garbage collector's counters, see gcStats()
+bool gcStatsNative(int argCount, Value* args){
+    if(argCount != 0){
+        args[-1] = errorOutput("Expected 0 arguments to gc_stats method.");
+        return false;
+    }
+    GCStat stats[GC_STATS_MAX];
+    int count = gcStats(stats);
+
+    ObjMap* map = newMap();
+    // keep the map reachable while its keys are allocated
+    push(OBJ_VAL(map));
+    for(int i = 0; i < count; i++){
+        Value name = OBJ_VAL(copyString(stats[i].name, strlen(stats[i].name)));
+        push(name);
+        mapSet(map, name, NUMBER_VAL(stats[i].value));
+        WRITE_BARRIER(map);
+        pop();
+    }
+    pop();
+
+    args[-1] = OBJ_VAL(map);
+    return true;
+}
+
 bool lenNative(int argCount, Value* args){
     Value item = args[0];
     if(argCount != 1){
         args[-1] = errorOutput("Expected 1 argument to len method.");
         return false;
     }
-    if(!IS_STRING(item) && !IS_LIST(item) && !IS_MAP(item) ){
-        args[-1] = errorOutput("Invalid datatype for len method. Expected type: String, List, Map.");
+    if(!IS_STRING(item) && !IS_LIST(item) && !IS_MAP(item) && !IS_BUILDER(item)){
+        args[-1] = errorOutput("Invalid datatype for len method. Expected type: String, List, Map, Builder.");
         return false;
     }
     args[-1] = NUMBER_VAL(objectLength(item));
@@ -44,6 +95,113 @@ bool strNative(int argCount, Value* args){
     return true;
 }
 
+static bool isSpace(char c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// num(text): the number text spells, spaces around it aside, or null if it
+// isn't one
+bool numNative(int argCount, Value* args){
+    if(argCount != 1){
+        args[-1] = errorOutput("Expected 1 argument to num method.");
+        return false;
+    }
+    if(IS_NUMBER(args[0])){
+        args[-1] = args[0];
+        return true;
+    }
+    if(!IS_STRING(args[0])){
+        args[-1] = errorOutput("Invalid datatype for num method. Expected type: String, Number.");
+        return false;
+    }
+
+    ObjString* string = AS_STRING(args[0]);
+    const char* start = stringChars(string);
+    const char* end = start + string->length;
+    while(start < end && isSpace(*start)) start++;
+    while(end > start && isSpace(end[-1])) end--;
+
+    double number;
+    int length = (int)(end - start);
+    if(length > 0 && parseNumber(start, length, &number) == length){
+        args[-1] = NUMBER_VAL(number);
+    } else {
+        args[-1] = NULL_VAL;
+    }
+    return true;
+}
+
+// New empty string builder
+bool builderNative(int argCount, Value* args){
+    if(argCount != 0){
+        args[-1] = errorOutput("Expected 0 arguments to builder method.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newBuilder());
+    return true;
+}
+
+// Appends the text of every argument, returns the builder so calls chain
+bool builderAppend(int argCount, Value self, Value* args){
+    ObjBuilder* builder = AS_BUILDER(self);
+    for(int i = 0; i < argCount; i++){
+        appendValue(builder, args[i]);
+    }
+    args[-1] = self;
+    return true;
+}
+
+bool builderBuild(int argCount, Value self, Value* args){
+    if(argCount != 0){
+        args[-1] = errorOutput("Expected 0 arguments to build method.");
+        return false;
+    }
+    ObjBuilder* builder = AS_BUILDER(self);
+    const char* chars = builder->chars != NULL ? builder->chars : "";
+    args[-1] = OBJ_VAL(copyString(chars, builder->length));
+    return true;
+}
+
+void initBuilderNativeMethods(Table* methods){
+    addNativeObjMethod(methods, "append", builderAppend);
+    addNativeObjMethod(methods, "build", builderBuild);
+}
+
+// join(list, separator): the strings and numbers of list in one string
+bool joinNative(int argCount, Value* args){
+    if(argCount != 1 && argCount != 2){
+        args[-1] = errorOutput("Expected 1 or 2 arguments to join method.");
+        return false;
+    }
+    if(!IS_LIST(args[0])){
+        args[-1] = errorOutput("Invalid datatype for list argument. Expected type: List.");
+        return false;
+    }
+
+    ObjString* separator;
+    if(argCount == 2){
+        if(!IS_STRING(args[1])){
+            args[-1] = errorOutput("Invalid datatype for separator argument. Expected type: String.");
+            return false;
+        }
+        separator = AS_STRING(args[1]);
+    } else {
+        separator = copyString("", 0);
+        push(OBJ_VAL(separator));
+    }
+
+    ObjList* list = AS_LIST(args[0]);
+    ObjString* result = joinValues(list->array.values, list->array.count, separator);
+    if(argCount == 1) pop();
+
+    if(result == NULL){
+        args[-1] = errorOutput("Expected only strings and numbers in list to join.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
 bool fileNative(int argCount, Value* args){
     if(argCount == 0){
         args[-1] = errorOutput("Expected atleast 1 argument to file method.");
@@ -73,10 +231,13 @@ bool fileNative(int argCount, Value* args){
     //     return false;
     // }
 
+    // The default mode isn't referenced anywhere else yet
+    push(mode);
     ObjFile* file = file_open(
         AS_STRING(path),
         AS_STRING(mode)
     );
+    pop();
 
     if(!file->isOpen){
         args[-1] = errorOutput("Invalid file path.");
@@ -107,8 +268,14 @@ bool to_bytes(int argCount, Value* args){
 
 void registerBuiltInFunctions(){
     defineNative("clock", clockNative);
+    defineNative("gc_max_pause", gcMaxPauseNative);
+    defineNative("gc_compact", gcCompactNative);
+    defineNative("gc_stats", gcStatsNative);
     defineNative("len", lenNative);
     defineNative("str", strNative);
+    defineNative("num", numNative);
+    defineNative("builder", builderNative);
+    defineNative("join", joinNative);
     defineNative("file", fileNative);
     defineNative("bytes", to_bytes);
 }
\ No newline at end of file
@@ -1,9 +1,11 @@
 #ifndef viper_builtin_h
 #define viper_builtin_h
 
+#include "table.h"
 #include "value.h"
 
 void registerBuiltInFunctions();
+void initBuilderNativeMethods(Table* methods);
 Value errorOutput(const char* message);
 
 #endif
\ No newline at end of file
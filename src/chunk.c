@@ -10,6 +10,9 @@ void initChunk(Chunk* chunk){
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line){
@@ -29,6 +32,7 @@ void freeChunk(Chunk* chunk){
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
@@ -39,6 +43,22 @@ int addConstant(Chunk* chunk, Value value){
     return chunk->constants.count - 1;
 }
 
+// Adds an empty inline cache and returns its index
+int addInlineCache(Chunk* chunk){
+    if(chunk->cacheCapacity < chunk->cacheCount + 1){
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->shape = NULL;
+    cache->transition = NULL;
+    cache->index = CACHE_EMPTY;
+    cache->method = NULL_VAL;
+    return chunk->cacheCount++;
+}
+
 void writeConstant(Chunk* chunk, Value value, int line) {
     int index = addConstant(chunk, value);
     if(index < 256){
@@ -35,7 +35,6 @@ typedef enum {
     OP_SET_UPVALUE,
     OP_CALL,
     OP_CLOSURE,
-    OBJ_UPVALUE,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
     OP_SET_PROPERTY,
@@ -50,21 +49,67 @@ typedef enum {
     OP_INDEX,
     OP_SET_INDEX,
     OP_DUP,
+    OP_ADD_TEMP,                  // OP_ADD whose left operand is what another OP_ADD left
+
+    // Superinstructions: fused forms of the most frequent opcode
+    // sequences, selected by the compiler (see DEBUG_PROFILE_OPCODES)
+    OP_NOT_EQUAL,                 // OP_EQUAL, OP_NOT
+    OP_GREATER_EQUAL,             // OP_LESS, OP_NOT
+    OP_LESS_EQUAL,                // OP_GREATER, OP_NOT
+    OP_ADD_LOCALS,                // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+    OP_SET_LOCAL_POP,             // OP_SET_LOCAL a, OP_POP
+    OP_INCREMENT_LOCAL,           // OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD, OP_SET_LOCAL a, OP_POP
+    OP_LESS_LOCAL_CONSTANT_JUMP,  // OP_GET_LOCAL a, OP_CONSTANT k, OP_LESS, OP_JUMP_IF_FALSE
+
+    // Quickened instructions: never emitted by the compiler. The VM writes
+    // them over the generic opcode once it has seen two number operands and
+    // writes the generic opcode back if that stops being true.
+    OP_ADD_NUM,
+    OP_ADD_TEMP_NUM,   // written back as OP_ADD_TEMP
+    OP_MINUS_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_MOD_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
 } OpCode;
 
 
+#define CACHE_EMPTY -2
+#define CACHE_METHOD -1
+
+// Inline cache of one property access or invoke instruction. It remembers
+// what the lookup resolved to for the last receiver shape seen there. A
+// shape belongs to one class and fixes which fields exist, so it decides
+// both field slots and whether a method is shadowed by a field.
+typedef struct {
+    ObjShape* shape;      // receiver shape the entry was filled for
+    ObjShape* transition; // shape after OP_SET_PROPERTY added the field
+    int index;            // field slot, CACHE_METHOD or CACHE_EMPTY
+    Value method;         // the method closure when index is CACHE_METHOD
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines; // TODO: Run-length encoding
     ValueArray constants;
+
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
 
 
 void writeConstant(Chunk* chunk, Value value, int line);
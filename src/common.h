@@ -10,10 +10,19 @@
 #define NAN_BOXING
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#define DEBUG_PROFILE_OPCODES
+#define DEBUG_INLINE_CACHE
 
 #define DEBUG_STRESS_GC 
 #define DEBUG_LOG_GC
 
+// Dispatch instructions through a table of label addresses (GCC/Clang
+// labels-as-values) instead of a switch. Build with -DVIPER_NO_COMPUTED_GOTO
+// to force the portable switch dispatch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VIPER_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 // No. of local variables that can persist in a scope
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -21,6 +30,13 @@
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_TRACE_EXECUTION
 
+// Remove below line to count executed opcode pairs and print the most
+// frequent ones on exit
+#undef DEBUG_PROFILE_OPCODES
+
+// Remove below line to print inline cache hit/miss counts on exit
+#undef DEBUG_INLINE_CACHE
+
 #undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
 
@@ -5,6 +5,9 @@
 #include "object.h"
 #include "token.h"
 
+// No. of trailing instructions the compiler remembers for fusing
+#define RECENT_INSTRUCTIONS 4
+
 typedef struct{
     Token name;
     int depth;
@@ -29,6 +32,13 @@ typedef struct {
     int scopeDepth;
 
     Upvalue upvalues[UINT8_COUNT];
+
+    // Peephole state used to select superinstructions: start offsets of
+    // the last few instructions (oldest first, -1 if none), how far the
+    // chunk has been decoded, and the last offset a jump lands on.
+    int recentStarts[RECENT_INSTRUCTIONS];
+    int decodedCount;
+    int lastJumpTarget;
 } Compiler;
 
 #endif
\ No newline at end of file
@@ -5,6 +5,10 @@
 #include "compiler.h"
 #include "comp.h"
 
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
 ParseRule* getRule(Parser* parser, TokenType type);
 void parsePrecedence(Parser* parser, Precedence precedence);
 void expression(Parser* parser);
@@ -24,6 +28,7 @@ uint8_t argumentList(Parser* parser, TokenType);
 void this_(Parser* parser, bool);
 void super_(Parser* parser, bool);
 void index_expr(Parser* parser, bool);
+int instructionLength(Chunk* chunk, int offset);
 
 ParseRule rules[] = {
   [TOKEN_LEFT_BRACKET]  = {list_literal,     index_expr,   PREC_INDEX},
@@ -96,6 +101,12 @@ void initCompiler(Parser* parser, Compiler* compiler, FunctionType type){
     compiler->scopeDepth = 0;
     compiler->function = newFunction();
 
+    for(int i = 0; i < RECENT_INSTRUCTIONS; i++){
+        compiler->recentStarts[i] = -1;
+    }
+    compiler->decodedCount = 0;
+    compiler->lastJumpTarget = 0;
+
     parser->vm->compiler = compiler;
     
     // Copy function name
@@ -190,7 +201,153 @@ void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2){
     emitByte(parser, byte2);
 }
 
+// Superinstruction selection
+//
+// Fusing is done while emitting: before an opcode that can end a fused
+// sequence is written, the trailing instructions are compared against the
+// sequence and, on a match, dropped and replaced by the superinstruction.
+// A sequence is never fused across an offset that some jump lands on.
+
+// Records the start of every instruction emitted since the last call.
+// Only called between whole instructions.
+void trackInstructions(Parser* parser){
+    Compiler* compiler = parser->vm->compiler;
+    Chunk* chunk = currentChunk(parser);
+
+    while(compiler->decodedCount < chunk->count){
+        for(int i = 0; i < RECENT_INSTRUCTIONS - 1; i++){
+            compiler->recentStarts[i] = compiler->recentStarts[i + 1];
+        }
+        compiler->recentStarts[RECENT_INSTRUCTIONS - 1] = compiler->decodedCount;
+        compiler->decodedCount += instructionLength(chunk, compiler->decodedCount);
+    }
+}
+
+// Offset of the start of the instruction `back` instructions from the
+// end (1 = last one), or -1 if it can't take part in a fused sequence.
+int recentInstruction(Parser* parser, int back){
+    Compiler* compiler = parser->vm->compiler;
+    int start = compiler->recentStarts[RECENT_INSTRUCTIONS - back];
+
+    if(start < compiler->lastJumpTarget) return -1;
+    return start;
+}
+
+// Drops every instruction from start onwards so a fused one can be
+// emitted in their place.
+void rewindTo(Parser* parser, int start){
+    Compiler* compiler = parser->vm->compiler;
+
+    while(compiler->recentStarts[RECENT_INSTRUCTIONS - 1] >= start){
+        for(int i = RECENT_INSTRUCTIONS - 1; i > 0; i--){
+            compiler->recentStarts[i] = compiler->recentStarts[i - 1];
+        }
+        compiler->recentStarts[0] = -1;
+    }
+
+    compiler->decodedCount = start;
+    currentChunk(parser)->count = start;
+}
+
+// Marks the current offset as the target of a jump or loop
+void markJumpTarget(Parser* parser){
+    parser->vm->compiler->lastJumpTarget = currentChunk(parser)->count;
+}
+
+bool isNumberConstant(Parser* parser, uint8_t constant){
+    return IS_NUMBER(currentChunk(parser)->constants.values[constant]);
+}
+
+// Whether the last instruction is an addition no jump lands after, so
+// an operator parsed next gets its result as left operand and nothing else
+bool endsWithAdd(Parser* parser){
+    trackInstructions(parser);
+    Chunk* chunk = currentChunk(parser);
+    int last = recentInstruction(parser, 1);
+
+    if(last == -1 || chunk->count == parser->vm->compiler->lastJumpTarget){
+        return false;
+    }
+    return chunk->code[last] == OP_ADD || chunk->code[last] == OP_ADD_TEMP ||
+        chunk->code[last] == OP_ADD_LOCALS;
+}
+
+// Emits OP_ADD, or OP_ADD_LOCALS when both operands are plain locals.
+// OP_ADD_TEMP is emitted when the left operand is the result of another
+// addition, which the VM may free once it has been concatenated.
+void emitAdd(Parser* parser, bool temporaryLeft){
+    trackInstructions(parser);
+    Chunk* chunk = currentChunk(parser);
+    int first = recentInstruction(parser, 2);
+
+    if(first != -1 && chunk->code[first] == OP_GET_LOCAL &&
+        chunk->code[first + 2] == OP_GET_LOCAL){
+        uint8_t a = chunk->code[first + 1];
+        uint8_t b = chunk->code[first + 3];
+        rewindTo(parser, first);
+        emitBytes(parser, OP_ADD_LOCALS, a);
+        emitByte(parser, b);
+        return;
+    }
+
+    emitByte(parser, temporaryLeft ? OP_ADD_TEMP : OP_ADD);
+}
+
+// Emits the OP_POP ending an expression statement, folding it into a
+// preceding local assignment (OP_SET_LOCAL_POP) or `a = a + k` with a
+// number constant k (OP_INCREMENT_LOCAL).
+void emitStatementPop(Parser* parser){
+    trackInstructions(parser);
+    Chunk* chunk = currentChunk(parser);
+    int first = recentInstruction(parser, 4);
+    int last = recentInstruction(parser, 1);
+
+    if(first != -1 && chunk->code[first] == OP_GET_LOCAL &&
+        chunk->code[first + 2] == OP_CONSTANT &&
+        chunk->code[first + 4] == OP_ADD &&
+        chunk->code[first + 5] == OP_SET_LOCAL &&
+        chunk->code[first + 6] == chunk->code[first + 1] &&
+        isNumberConstant(parser, chunk->code[first + 3])){
+        uint8_t slot = chunk->code[first + 1];
+        uint8_t constant = chunk->code[first + 3];
+        rewindTo(parser, first);
+        emitBytes(parser, OP_INCREMENT_LOCAL, slot);
+        emitByte(parser, constant);
+        return;
+    }
+
+    if(last != -1 && chunk->code[last] == OP_SET_LOCAL){
+        uint8_t slot = chunk->code[last + 1];
+        rewindTo(parser, last);
+        emitBytes(parser, OP_SET_LOCAL_POP, slot);
+        return;
+    }
+
+    emitByte(parser, OP_POP);
+}
+
 int emitJump(Parser* parser, uint8_t instruction){
+    if(instruction == OP_JUMP_IF_FALSE){
+        trackInstructions(parser);
+        Chunk* chunk = currentChunk(parser);
+        int first = recentInstruction(parser, 3);
+
+        // `local < k` as a condition: compare and branch in one instruction,
+        // still leaving the result on the stack for the OP_POPs that follow
+        if(first != -1 && chunk->code[first] == OP_GET_LOCAL &&
+            chunk->code[first + 2] == OP_CONSTANT &&
+            chunk->code[first + 4] == OP_LESS &&
+            isNumberConstant(parser, chunk->code[first + 3])){
+            uint8_t slot = chunk->code[first + 1];
+            uint8_t constant = chunk->code[first + 3];
+            rewindTo(parser, first);
+            emitBytes(parser, OP_LESS_LOCAL_CONSTANT_JUMP, slot);
+            emitBytes(parser, constant, 0xff);
+            emitByte(parser, 0xff);
+            return currentChunk(parser)->count - 2;
+        }
+    }
+
     emitByte(parser, instruction);
     emitByte(parser, 0xff);
     emitByte(parser, 0xff);
@@ -207,6 +364,19 @@ void emitLoop(Parser* parser, int loopStart){
     emitByte(parser, offset & 0xff);
 }
 
+// Emits the two byte index of a new inline cache for the instruction
+// being emitted
+void emitInlineCache(Parser* parser){
+    int cache = addInlineCache(currentChunk(parser));
+
+    if(cache > UINT16_MAX){
+        error(parser, "Too many property accesses in one chunk.");
+    }
+
+    emitByte(parser, (cache >> 8) & 0xff);
+    emitByte(parser, cache & 0xff);
+}
+
 void emitReturn(Parser* parser){
     if(parser->vm->compiler->type == TYPE_INITIALIZER){
         emitBytes(parser, OP_GET_LOCAL, 0);
@@ -244,21 +414,239 @@ void patchJump(Parser* parser, int offset){
 
     currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
     currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    markJumpTarget(parser);
+
+}
+
+// Size in bytes of the instruction at offset, including operands
+int instructionLength(Chunk* chunk, int offset){
+    switch(chunk->code[offset]){
+        case OP_CONSTANT_LONG:
+            return 4;
+
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCALS:
+        case OP_INCREMENT_LOCAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            return 3;
+
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY:
+            return 4;
+
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+        case OP_INVOKE:
+            return 5;
+
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_LIST:
+        case OP_MAP:
+        case OP_INDEX:
+        case OP_SET_LOCAL_POP:
+            return 2;
+
+        case OP_CLOSURE:{
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+
+        default:
+            return 1;
+    }
+}
+
+// Net change in stack depth after executing the instruction at offset
+int stackEffect(Chunk* chunk, int offset){
+    uint8_t operand = offset + 1 < chunk->count ? chunk->code[offset + 1] : 0;
+
+    switch(chunk->code[offset]){
+        case OP_CONSTANT_LONG:
+        case OP_CONSTANT:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_DUP:
+        case OP_ADD_LOCALS:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return 1;
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_ADD_TEMP:
+        case OP_MINUS:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_RETURN:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_SET_LOCAL_POP:
+        case OP_ADD_NUM:
+        case OP_ADD_TEMP_NUM:
+        case OP_MINUS_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_MOD_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_EQUAL_NUM:
+        case OP_NOT_EQUAL_NUM:
+            return -1;
+
+        case OP_SET_INDEX:
+            return -2;
+
+        case OP_CALL:
+            return -operand;
+
+        case OP_INVOKE:
+            return -chunk->code[offset + 2];
+
+        case OP_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+
+        case OP_LIST:
+            return 1 - operand;
+
+        case OP_MAP:
+            return 1 - 2 * operand;
+
+        case OP_INDEX:
+            return -operand;
+
+        default:
+            return 0;
+    }
+}
+
+// Walks every reachable path through the chunk and returns the deepest
+// stack a frame running it can reach, starting from initialDepth slots
+// (the callee and its parameters).
+int computeMaxStack(Chunk* chunk, int initialDepth){
+    if(chunk->count == 0) return initialDepth;
+
+    int* depths = ALLOCATE(int, chunk->count);
+    int* worklist = ALLOCATE(int, chunk->count);
+    bool* queued = ALLOCATE(bool, chunk->count);
+    int worklistCount = 0;
+    int maxDepth = initialDepth;
+
+    // depth can only keep growing along a path if the code is unbalanced
+    int depthLimit = initialDepth + chunk->count;
+
+    for(int i = 0; i < chunk->count; i++){
+        depths[i] = -1;
+        queued[i] = false;
+    }
+
+    depths[0] = initialDepth;
+    worklist[worklistCount++] = 0;
+    queued[0] = true;
+
+    while(worklistCount > 0){
+        int offset = worklist[--worklistCount];
+        int depth = depths[offset];
+        queued[offset] = false;
+
+        for(;;){
+            uint8_t instruction = chunk->code[offset];
+            int length = instructionLength(chunk, offset);
+
+            // OP_LIST and OP_MAP keep the new object on top of its items while
+            // filling it, OP_ADD_LOCALS pushes both operands when concatenating
+            // strings
+            if((instruction == OP_LIST || instruction == OP_MAP) && depth + 1 > maxDepth){
+                maxDepth = depth + 1;
+            }
+            if(instruction == OP_ADD_LOCALS && depth + 2 > maxDepth) maxDepth = depth + 2;
+
+            depth += stackEffect(chunk, offset);
+            if(depth > maxDepth) maxDepth = depth;
+
+            if(instruction == OP_RETURN) break;
+
+            int next = offset + length;
+            int target = -1;
+
+            if(instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP ||
+                instruction == OP_LESS_LOCAL_CONSTANT_JUMP){
+                // the jump offset is always the last two bytes
+                uint16_t jump = (uint16_t)((chunk->code[next - 2] << 8) | chunk->code[next - 1]);
+                target = instruction == OP_LOOP ? next - jump : next + jump;
+            }
+
+            if(target != -1 && target < chunk->count &&
+                depth > depths[target] && depth <= depthLimit){
+                depths[target] = depth;
+                if(!queued[target]){
+                    queued[target] = true;
+                    worklist[worklistCount++] = target;
+                }
+            }
+
+            // Unconditional jumps don't fall through
+            if(instruction == OP_JUMP || instruction == OP_LOOP) break;
+            if(next >= chunk->count) break;
+
+            if(depth <= depths[next] || depth > depthLimit) break;
+            depths[next] = depth;
+            offset = next;
+        }
+    }
 
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(int, worklist, chunk->count);
+    FREE_ARRAY(bool, queued, chunk->count);
+    return maxDepth;
 }
 
 ObjFunction* endCompiler(Parser* parser){
     emitReturn(parser);
     ObjFunction* function = parser->vm->compiler->function;
+    function->maxStack = computeMaxStack(&function->chunk, function->arity + 1);
 
 #ifdef DEBUG_PRINT_CODE
-    if(!parser.hadError){
+    if(!parser->hadError){
         disassembleChunk(currentChunk(parser), function->name != NULL ? 
             function->name->chars: "<script>");
+        printf("max stack: %d\n", function->maxStack);
     }
 #endif
 
     parser->vm->compiler = (Compiler*) parser->vm->compiler->enclosing;
+    // No longer a compiler root, remember what it got while it was one
+    WRITE_BARRIER(function);
     return function;
 }
 
@@ -297,6 +685,29 @@ uint8_t identifierConstant(Parser* parser, Token* name){
     );
 }
 
+// Slot of a global variable in vm.globalValues, resolved at compile time
+uint16_t identifierGlobal(Parser* parser, Token* name){
+    int slot = globalSlot(copyString(name->start, name->length));
+
+    if(slot > UINT16_MAX){
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t) slot;
+}
+
+// Emits a variable access instruction. Globals take a two byte slot
+// operand, locals and upvalues a single byte.
+void emitVariable(Parser* parser, uint8_t op, int arg){
+    if(op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL){
+        emitBytes(parser, op, (arg >> 8) & 0xff);
+        emitByte(parser, arg & 0xff);
+    } else {
+        emitBytes(parser, op, (uint8_t) arg);
+    }
+}
+
 bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -391,7 +802,7 @@ void declareVariable(Parser* parser){
     addLocal(parser, *name);
 }
 
-uint8_t parseVariable(Parser* parser, const char* errorMessage){
+uint16_t parseVariable(Parser* parser, const char* errorMessage){
     consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable(parser);
@@ -400,7 +811,7 @@ uint8_t parseVariable(Parser* parser, const char* errorMessage){
     // at runtime, locals are not looked up
     if(parser->vm->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(parser, &parser->previous);
+    return identifierGlobal(parser, &parser->previous);
 }
 
 void markInitialized(Parser* parser){
@@ -416,18 +827,19 @@ ParseRule* getRule(Parser* parser, TokenType type){
 void binary(Parser* parser, bool canAssign){
     TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(parser, operatorType);
+    bool temporaryLeft = operatorType == TOKEN_ADD && endsWithAdd(parser);
     parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operatorType)
     {
-        case TOKEN_NOT_EQUAL:               emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_NOT_EQUAL:               emitByte(parser, OP_NOT_EQUAL); break;
         case TOKEN_EQUAL_EQUAL:             emitByte(parser, OP_EQUAL); break;
         case TOKEN_GREATER:                 emitByte(parser, OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:           emitBytes(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_GREATER_EQUAL:           emitByte(parser, OP_GREATER_EQUAL); break;
         case TOKEN_LESS:                    emitByte(parser, OP_LESS); break;
-        case TOKEN_LESS_EQUAL:              emitBytes(parser, OP_GREATER, OP_NOT); break;
+        case TOKEN_LESS_EQUAL:              emitByte(parser, OP_LESS_EQUAL); break;
 
-        case TOKEN_ADD:                     emitByte(parser, OP_ADD); break;
+        case TOKEN_ADD:                     emitAdd(parser, temporaryLeft); break;
         case TOKEN_MINUS:                   emitByte(parser, OP_MINUS); break;
         case TOKEN_MULTIPLY:                emitByte(parser, OP_MULTIPLY); break;
         case TOKEN_DIVIDE:                  emitByte(parser, OP_DIVIDE); break;
@@ -496,7 +908,8 @@ Value compile_number_value(Parser* parser){
         }
     
         default:{
-            double value = strtod(parser->previous.start, NULL);
+            double value;
+            parseNumber(parser->previous.start, parser->previous.length, &value);
             return NUMBER_VAL(value);
         }
     }
@@ -576,14 +989,14 @@ void declaration(Parser* parser){
 
 
 // Variable ready to use.
-void defineVariable(Parser* parser, uint8_t global){
+void defineVariable(Parser* parser, uint16_t global){
     // local variable not processed until runtime
     if(parser->vm->compiler->scopeDepth > 0){
         markInitialized(parser);
         return;
     }
 
-    emitBytes(parser, OP_DEFINE_GLOBAL, global);
+    emitVariable(parser, OP_DEFINE_GLOBAL, global);
 }
 
 // AND statement
@@ -609,7 +1022,7 @@ void or_(Parser* parser, bool canAssign){
 
 // Variable Declaraction
 void varDeclaraction(Parser* parser){
-    uint8_t global = parseVariable(parser, "Expected variable name.");
+    uint16_t global = parseVariable(parser, "Expected variable name.");
 
     if(match_parser(parser, TOKEN_EQUAL)){
         expression(parser);
@@ -623,7 +1036,7 @@ void varDeclaraction(Parser* parser){
 
 // Function Declaration
 void functionDeclaration(Parser* parser){
-    uint8_t global = parseVariable(parser, "Expected function name.");
+    uint16_t global = parseVariable(parser, "Expected function name.");
     markInitialized(parser);
     function(parser, TYPE_FUNCTION);
     defineVariable(parser, global);
@@ -644,8 +1057,8 @@ void function(Parser* parser, FunctionType type){
             if(parser->vm->compiler->function->arity > 255){
                 errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable(parser, "Expected parameter name");
-            defineVariable(parser, constant);
+            uint16_t local = parseVariable(parser, "Expected parameter name");
+            defineVariable(parser, local);
         } while(match_parser(parser, TOKEN_COMMA));
     }
 
@@ -697,8 +1110,13 @@ void classDeclaration(Parser* parser){
     uint8_t nameConstant = identifierConstant(parser, &className);
     declareVariable(parser);
 
+    uint16_t global = 0;
+    if(parser->vm->compiler->scopeDepth == 0){
+        global = identifierGlobal(parser, &className);
+    }
+
     emitBytes(parser, OP_CLASS, nameConstant);
-    defineVariable(parser, nameConstant);
+    defineVariable(parser, global);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -750,13 +1168,16 @@ void dot(Parser* parser, bool canAssign){
     if(canAssign && match_parser(parser, TOKEN_EQUAL)){
         expression(parser);
         emitBytes(parser, OP_SET_PROPERTY, name);
+        emitInlineCache(parser);
     } else if(match_parser(parser, TOKEN_LEFT_PAREN)){
         // method invocation
         uint8_t argCount = argumentList(parser, TOKEN_RIGHT_PAREN);
         emitBytes(parser, OP_INVOKE, name);
         emitByte(parser, argCount);
+        emitInlineCache(parser);
     } else {
         emitBytes(parser, OP_GET_PROPERTY, name);
+        emitInlineCache(parser);
     }
 }
 
@@ -785,11 +1206,15 @@ void call(Parser* parser, bool canAsign){
     emitBytes(parser, OP_CALL, argCount);
 }
 
-void emitShorthandAssign(Parser* parser, uint8_t getOp, uint8_t setOp, OpCode op, uint8_t args){
-    emitBytes(parser, getOp, args);
+void emitShorthandAssign(Parser* parser, uint8_t getOp, uint8_t setOp, OpCode op, int arg){
+    emitVariable(parser, getOp, arg);
     expression(parser);
-    emitByte(parser, op);
-    emitBytes(parser, setOp, args);
+    if(op == OP_ADD){
+        emitAdd(parser, false);
+    } else {
+        emitByte(parser, op);
+    }
+    emitVariable(parser, setOp, arg);
 }
 
 
@@ -806,27 +1231,27 @@ void namedVariable(Parser* parser, Token name, bool canAssign){
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(parser, &name);
+        arg = identifierGlobal(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     
     if(canAssign && match_parser(parser, TOKEN_EQUAL)){
         expression(parser);
-        emitBytes(parser, setOp, (uint8_t) arg);
+        emitVariable(parser, setOp, arg);
     } else if(canAssign && match_parser(parser, TOKEN_ADD_EQUAL)){
-        emitShorthandAssign(parser, getOp, setOp, OP_ADD, (uint8_t) arg);
+        emitShorthandAssign(parser, getOp, setOp, OP_ADD, arg);
     } else if(canAssign && match_parser(parser, TOKEN_MINUS_EQUAL)){
-        emitShorthandAssign(parser, getOp, setOp, OP_MINUS, (uint8_t) arg);
+        emitShorthandAssign(parser, getOp, setOp, OP_MINUS, arg);
     } else if(canAssign && match_parser(parser, TOKEN_MULTIPLY_EQUAL)){
-        emitShorthandAssign(parser, getOp, setOp, OP_MULTIPLY, (uint8_t) arg);
+        emitShorthandAssign(parser, getOp, setOp, OP_MULTIPLY, arg);
     } else if(canAssign && match_parser(parser, TOKEN_DIVIDE_EQUAL)){
-        emitShorthandAssign(parser, getOp, setOp, OP_DIVIDE, (uint8_t) arg);
+        emitShorthandAssign(parser, getOp, setOp, OP_DIVIDE, arg);
     } else if(canAssign && match_parser(parser, TOKEN_MOD_EQUAL)){
-        emitShorthandAssign(parser, getOp, setOp, OP_MOD, (uint8_t) arg);
+        emitShorthandAssign(parser, getOp, setOp, OP_MOD, arg);
     }
     else {
-        emitBytes(parser, getOp, (uint8_t) arg);
+        emitVariable(parser, getOp, arg);
     }
 }
 
@@ -905,6 +1330,7 @@ void printStatement(Parser* parser){
 // Loop - While Statement
 void whileStatement(Parser* parser){
     int loopStart = currentChunk(parser)->count;
+    markJumpTarget(parser);
 
     // Enclosing condition inside '(' ')' is optional 
     bool paranFound = match_parser(parser, TOKEN_LEFT_PAREN);
@@ -948,6 +1374,7 @@ void forStatement(Parser* parser){
     
     // Condition
     int loopStart = currentChunk(parser)->count;
+    markJumpTarget(parser);
     int exitJump = -1;
     if(!match_parser(parser, TOKEN_SEMICOLON)){
         expression(parser);
@@ -963,10 +1390,11 @@ void forStatement(Parser* parser){
         // track where increment expression begins in stack
         int bodyJump = emitJump(parser, OP_JUMP);
         int incrementStart = currentChunk(parser)->count;
+        markJumpTarget(parser);
 
         // parse increment expression
         expression(parser);
-        emitByte(parser, OP_POP);
+        emitStatementPop(parser);
         if(paranFound){
             consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' for closing condition.");
         }
@@ -1086,7 +1514,7 @@ void switchStatement(Parser* parser){
 void expressionStatement(Parser* parser){
     expression(parser);
     match_parser(parser, TOKEN_SEMICOLON);
-    emitByte(parser, OP_POP);
+    emitStatementPop(parser);
 }
 
 ObjFunction* compile(VM* vm, const char* source){
@@ -1199,11 +1627,24 @@ void ifStatement(Parser* parser){
 void markCompilerRoots(VM* vm){
     Compiler* compiler = vm->compiler;
     while(compiler != NULL){
+        // Functions being compiled keep getting constants, so they are
+        // traced even once they are old
+        WRITE_BARRIER(compiler->function);
         markObject((Obj*)compiler->function);
         compiler = (Compiler *)(compiler->enclosing);
     }
 }
 
+void forwardCompilerRoots(VM* vm){
+    Compiler* compiler = vm->compiler;
+    while(compiler != NULL){
+        compiler->function = (ObjFunction*)forwardObject(
+            (Obj*)compiler->function
+        );
+        compiler = (Compiler *)(compiler->enclosing);
+    }
+}
+
 void this_(Parser* parser, bool canAssign){
     if(parser->currentClass == NULL){
         error(parser, "Can't use 'this' outside of a class.");
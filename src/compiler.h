@@ -94,5 +94,6 @@ void or_(Parser* parser, bool);
 void synchronize(Parser* parser);
 
 void markCompilerRoots(VM*);
+void forwardCompilerRoots(VM*);
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name){
     printf("== %s ==\n", name);
@@ -41,6 +42,9 @@ int disassembleInstruction(Chunk* chunk, int offset){
 
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
+
+        case OP_ADD_TEMP:
+            return simpleInstruction("OP_ADD_TEMP", offset);
         
         case OP_MINUS:
             return simpleInstruction("OP_MINUS", offset);
@@ -85,13 +89,13 @@ int disassembleInstruction(Chunk* chunk, int offset){
             return byteInstruction("OP_INDEX", chunk, offset);
         
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
 
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
 
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
 
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
@@ -130,16 +134,16 @@ int disassembleInstruction(Chunk* chunk, int offset){
             return constantInstruction("OP_CLASS", chunk, offset);
 
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
 
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
 
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
@@ -153,6 +157,63 @@ int disassembleInstruction(Chunk* chunk, int offset){
         case OP_DUP:
             return simpleInstruction("OP_DUP", offset);
 
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+
+        case OP_INCREMENT_LOCAL:
+            return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return localConstantJumpInstruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
+
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+
+        case OP_ADD_TEMP_NUM:
+            return simpleInstruction("OP_ADD_TEMP_NUM", offset);
+
+        case OP_MINUS_NUM:
+            return simpleInstruction("OP_MINUS_NUM", offset);
+
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+
+        case OP_MOD_NUM:
+            return simpleInstruction("OP_MOD_NUM", offset);
+
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+
+        case OP_LESS_EQUAL_NUM:
+            return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+
+        case OP_GREATER_EQUAL_NUM:
+            return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
+
+        case OP_NOT_EQUAL_NUM:
+            return simpleInstruction("OP_NOT_EQUAL_NUM", offset);
+
         case OP_CLOSURE:{
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -196,6 +257,14 @@ int constantInstruction(const char* name, Chunk* chunk, int offset){
     return offset + 2;
 }
 
+int globalInstruction(const char* name, Chunk* chunk, int offset){
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    ObjString* global = globalName(slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "");
+    return offset + 3;
+}
+
 int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset){
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -212,10 +281,98 @@ int invokeInstruction(const char* name, Chunk* chunk, int offset){
     return offset + 3;
 }
 
+int localsInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+int localConstantInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+int localConstantJumpInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset + 5 + jump);
+    return offset + 5;
+}
+
+int propertyInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
+}
+
 int longConstantInstruction(const char* name, Chunk* chunk, int offset){
     uint32_t constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 4;
-}
\ No newline at end of file
+}
+
+// Opcode pair profile (DEBUG_PROFILE_OPCODES). Used to pick which
+// sequences are worth fusing into superinstructions.
+static uint64_t opcodePairs[UINT8_COUNT][UINT8_COUNT];
+static int previousOpcode = -1;
+
+void profileOpcode(uint8_t instruction){
+    if(previousOpcode >= 0){
+        opcodePairs[previousOpcode][instruction]++;
+    }
+    previousOpcode = instruction;
+}
+
+void printOpcodeProfile(){
+    uint64_t total = 0;
+    for(int i = 0; i < UINT8_COUNT; i++){
+        for(int j = 0; j < UINT8_COUNT; j++){
+            total += opcodePairs[i][j];
+        }
+    }
+    if(total == 0) return;
+
+    fprintf(stderr, "== opcode pairs ==\n");
+    // Repeatedly pick the largest remaining pair; the table is small and
+    // this only runs once on exit.
+    for(int rank = 0; rank < 20; rank++){
+        int first = 0, second = 0;
+        for(int i = 0; i < UINT8_COUNT; i++){
+            for(int j = 0; j < UINT8_COUNT; j++){
+                if(opcodePairs[i][j] > opcodePairs[first][second]){
+                    first = i;
+                    second = j;
+                }
+            }
+        }
+        if(opcodePairs[first][second] == 0) break;
+        fprintf(stderr, "%3d -> %3d %12llu %5.1f%%\n", first, second,
+            (unsigned long long)opcodePairs[first][second],
+            100.0 * opcodePairs[first][second] / total);
+        opcodePairs[first][second] = 0;
+    }
+}
@@ -10,8 +10,17 @@ int disassembleInstruction(Chunk* chunk, int offset);
 int simpleInstruction(const char* name, int offset);
 int byteInstruction(const char* name, Chunk* chunk, int offset);
 int constantInstruction(const char* name, Chunk* chunk, int offset);
+int globalInstruction(const char* name, Chunk* chunk, int offset);
 int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
 int invokeInstruction(const char* name, Chunk* chunk, int offset);
+int propertyInstruction(const char* name, Chunk* chunk, int offset);
+int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset);
 int longConstantInstruction(const char* name, Chunk* chunk, int offset);
+int localsInstruction(const char* name, Chunk* chunk, int offset);
+int localConstantInstruction(const char* name, Chunk* chunk, int offset);
+int localConstantJumpInstruction(const char* name, Chunk* chunk, int offset);
+
+void profileOpcode(uint8_t instruction);
+void printOpcodeProfile();
 
 #endif
\ No newline at end of file
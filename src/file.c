@@ -162,7 +162,7 @@ bool file_write(int argCount, Value self, Value* args){
         length = bytes->bytes.count;       
     } else {
         ObjString* string = AS_STRING(args[0]);
-        data = (unsigned char *) string->chars;
+        data = (unsigned char *) stringChars(string);
         length = string->length;
     }
 
@@ -250,15 +250,15 @@ ObjFile* file_open(ObjString* path, ObjString* mode){
     return file;
 }
 
-void initFileNativeMethods(ObjFile* file){
-    addNativeObjMethod(&file->nativeMethods, "read", file_read);
-    addNativeObjMethod(&file->nativeMethods, "exists", file_exists);
-    addNativeObjMethod(&file->nativeMethods, "write", file_write);
-    addNativeObjMethod(&file->nativeMethods, "open", mfile_open);
-    addNativeObjMethod(&file->nativeMethods, "close", mfile_close);
-
-    addNativeObjMethod(&file->nativeMethods, "is_open", file_is_open);
-    addNativeObjMethod(&file->nativeMethods, "mode", file_mode);
-    addNativeObjMethod(&file->nativeMethods, "path", file_path);
-    addNativeObjMethod(&file->nativeMethods, "is_closed", file_is_closed);
+void initFileNativeMethods(Table* methods){
+    addNativeObjMethod(methods, "read", file_read);
+    addNativeObjMethod(methods, "exists", file_exists);
+    addNativeObjMethod(methods, "write", file_write);
+    addNativeObjMethod(methods, "open", mfile_open);
+    addNativeObjMethod(methods, "close", mfile_close);
+
+    addNativeObjMethod(methods, "is_open", file_is_open);
+    addNativeObjMethod(methods, "mode", file_mode);
+    addNativeObjMethod(methods, "path", file_path);
+    addNativeObjMethod(methods, "is_closed", file_is_closed);
 }
\ No newline at end of file
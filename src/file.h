@@ -3,10 +3,11 @@
 
 #include "common.h"
 #include "object.h"
+#include "table.h"
 
 bool is_valid_mode(const char* mode);
 
 ObjFile* file_open(ObjString* path, ObjString* mode);
-void initFileNativeMethods(ObjFile* file);
+void initFileNativeMethods(Table* methods);
 
 #endif
\ No newline at end of file
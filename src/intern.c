@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+
+#define INTERN_MIN_CAPACITY 64
+#define INTERN_MAX_LOAD 0.75
+// Below this load the table shrinks
+#define INTERN_MIN_LOAD 0.125
+// Load of a freshly resized table
+#define INTERN_RESIZE_LOAD 0.5
+
+// Old buckets moved by every operation while the table is resized
+#define INTERN_REHASH_STEP 16
+
+// Marks a bucket whose string was removed, so probes go on past it
+static ObjString tombstone;
+#define TOMBSTONE (&tombstone)
+
+void initInternTable(InternTable* table){
+    table->count = 0;
+    table->used = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    table->oldCapacity = 0;
+    table->rehashIndex = 0;
+    table->oldEntries = NULL;
+}
+
+// The arrays are owned by the VM like the collector's own lists, so
+// resizing from a sweep can't start another collection
+void freeInternTable(InternTable* table){
+    free(table->entries);
+    free(table->oldEntries);
+    initInternTable(table);
+}
+
+// Bucket of string in entries, or the empty one it goes to. Buckets below
+// skip only hold strings that moved, they are probed past.
+static ObjString** findBucket(ObjString** entries, int capacity, int skip,
+                              const char* chars, int length, uint32_t hash){
+    uint32_t index = hash & (capacity - 1);
+    for(;;){
+        ObjString** bucket = &entries[index];
+        ObjString* string = *bucket;
+        if(string == NULL) return bucket;
+        if(string != TOMBSTONE && (int)index >= skip &&
+            string->length == length && string->hash == hash &&
+            memcmp(string->chars, chars, length) == 0){
+            return bucket;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void insert(InternTable* table, ObjString* string){
+    uint32_t index = string->hash & (table->capacity - 1);
+    while(table->entries[index] != NULL && table->entries[index] != TOMBSTONE){
+        index = (index + 1) & (table->capacity - 1);
+    }
+    if(table->entries[index] == NULL) table->used++;
+    table->entries[index] = string;
+}
+
+static void rehash(InternTable* table, int buckets){
+    if(table->oldEntries == NULL) return;
+
+    while(buckets-- > 0 && table->rehashIndex < table->oldCapacity){
+        ObjString* string = table->oldEntries[table->rehashIndex++];
+        if(string != NULL && string != TOMBSTONE) insert(table, string);
+    }
+
+    if(table->rehashIndex == table->oldCapacity){
+        free(table->oldEntries);
+        table->oldEntries = NULL;
+        table->oldCapacity = 0;
+    }
+}
+
+// Starts moving the strings to an array sized for how many there are
+static void resize(InternTable* table){
+    rehash(table, table->oldCapacity);
+
+    int capacity = INTERN_MIN_CAPACITY;
+    while(table->count + 1 > capacity * INTERN_RESIZE_LOAD) capacity *= 2;
+
+    ObjString** entries = (ObjString**)calloc(capacity, sizeof(ObjString*));
+    // Unable to allocate memory for the intern table
+    if(entries == NULL) exit(1);
+
+    table->oldEntries = table->entries;
+    table->oldCapacity = table->capacity;
+    table->rehashIndex = 0;
+    table->entries = entries;
+    table->capacity = capacity;
+    table->used = 0;
+}
+
+ObjString* internFind(InternTable* table, const char* chars, int length,
+                      uint32_t hash){
+    if(table->count == 0) return NULL;
+    rehash(table, INTERN_REHASH_STEP);
+
+    ObjString* string = *findBucket(table->entries, table->capacity, 0,
+                                    chars, length, hash);
+    if(string == NULL && table->oldEntries != NULL){
+        string = *findBucket(table->oldEntries, table->oldCapacity,
+                             table->rehashIndex, chars, length, hash);
+    }
+    return string;
+}
+
+// Adds a string known not to be interned yet
+void internAdd(InternTable* table, ObjString* string){
+    rehash(table, INTERN_REHASH_STEP);
+    if(table->used + 1 > table->capacity * INTERN_MAX_LOAD) resize(table);
+
+    insert(table, string);
+    table->count++;
+}
+
+void internRemove(InternTable* table, ObjString* string){
+    if(table->count == 0) return;
+    rehash(table, INTERN_REHASH_STEP);
+
+    ObjString** bucket = findBucket(table->entries, table->capacity, 0,
+                                    string->chars, string->length, string->hash);
+    if(*bucket != string && table->oldEntries != NULL){
+        bucket = findBucket(table->oldEntries, table->oldCapacity,
+                            table->rehashIndex, string->chars,
+                            string->length, string->hash);
+    }
+    if(*bucket != string) return;
+
+    *bucket = TOMBSTONE;
+    table->count--;
+
+    if(table->oldEntries == NULL && table->capacity > INTERN_MIN_CAPACITY &&
+        table->count < table->capacity * INTERN_MIN_LOAD){
+        resize(table);
+    }
+}
+
+// Points the table to the strings' new addresses after a compaction.
+// Their hash doesn't change, so they stay in their buckets.
+void internForward(InternTable* table){
+    for(int i = 0; i < table->capacity; i++){
+        ObjString** bucket = &table->entries[i];
+        if(*bucket != NULL && *bucket != TOMBSTONE){
+            *bucket = (ObjString*)forwardObject((Obj*)*bucket);
+        }
+    }
+    for(int i = table->rehashIndex; i < table->oldCapacity; i++){
+        ObjString** bucket = &table->oldEntries[i];
+        if(*bucket != NULL && *bucket != TOMBSTONE){
+            *bucket = (ObjString*)forwardObject((Obj*)*bucket);
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef viper_intern_h
+#define viper_intern_h
+
+#include "common.h"
+#include "object.h"
+
+// Set of the interned strings. It doesn't keep them alive, the collector
+// removes each dead one as it frees it. Growing, shrinking or clearing out
+// tombstones moves the strings to a new array a few buckets at a time, so
+// no single string operation pays for the whole table.
+typedef struct {
+    int count;              // strings in either array
+    int used;               // non-empty buckets of entries, tombstones included
+    int capacity;
+    ObjString** entries;
+
+    // The array being emptied into entries, if any. Its buckets below
+    // rehashIndex have been moved.
+    int oldCapacity;
+    int rehashIndex;
+    ObjString** oldEntries;
+} InternTable;
+
+void initInternTable(InternTable* table);
+void freeInternTable(InternTable* table);
+ObjString* internFind(InternTable* table, const char* chars, int length,
+                      uint32_t hash);
+void internAdd(InternTable* table, ObjString* string);
+void internRemove(InternTable* table, ObjString* string);
+void internForward(InternTable* table);
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "builtin.h"
+#include "memory.h"
 #include "runtime.h"
 #include "table.h"
 #include "value.h"
@@ -15,6 +16,7 @@ bool appendList(int argCount, Value self, Value* args){
     ObjList* list = AS_LIST(self);
     Value item = args[0];
     writeValueArray(&list->array, item);
+    WRITE_BARRIER(list);
     args[-1] = self;
     return true;
 }
@@ -62,8 +64,8 @@ bool removeList(int argCount, Value self, Value* args){
     }
 }
 
-void initListNativeMethods(ObjList* list){
-    addNativeObjMethod(&list->nativeMethods, "push", appendList);
-    addNativeObjMethod(&list->nativeMethods, "pop", removeList);
+void initListNativeMethods(Table* methods){
+    addNativeObjMethod(methods, "push", appendList);
+    addNativeObjMethod(methods, "pop", removeList);
 }
 
@@ -2,7 +2,8 @@
 #define viper_list_h
 
 #include "object.h"
+#include "table.h"
 
-void initListNativeMethods(ObjList* list);
+void initListNativeMethods(Table* methods);
 
 #endif
\ No newline at end of file
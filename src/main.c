@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 void repl(VM* vm){
@@ -53,29 +55,99 @@ char* readFile(const char* path){
     return buffer;
 }
 
-void runFile(VM* vm, const char* path){
+// Returns the exit status of the script
+int runFile(VM* vm, const char* path){
     char* source = readFile(path);
     InterpretResult result = interpret(vm, source);
     free(source);
 
-    if(result == INTERPRET_COMPILE_ERROR) exit(65);
-    if(result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if(result == INTERPRET_COMPILE_ERROR) return 65;
+    if(result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static void printGCStats(){
+    GCStat stats[GC_STATS_MAX];
+    int count = gcStats(stats);
+
+    // After what the script printed
+    fflush(stdout);
+    fprintf(stderr, "-- GC stats\n");
+    for(int i = 0; i < count; i++){
+        fprintf(stderr, "%-22s %.10g\n", stats[i].name, stats[i].value);
+    }
+}
+
+static void usage(){
+    fprintf(stderr,
+        "Usage: viper [--gc-pause ms] [--gc-threads n] [--gc-stats]\n"
+        "             [--gc-initial-heap kb] [--gc-heap-grow factor]\n"
+        "             [--gc-nursery kb] [--gc-keep-temporaries]\n"
+        "             [--intern-max length] [path]\n");
+    exit(64);
+}
+
+// Parses a positive number of kilobytes into bytes
+static size_t kilobytes(const char* arg){
+    char* end;
+    double kb = strtod(arg, &end);
+    if(*end != '\0' || kb <= 0) usage();
+    return (size_t)(kb * 1024);
 }
 
 int main(int argc, const char* argv[]){
     initVM();
-    
+
+    const char* path = NULL;
+    bool gcStats = false;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--gc-pause") == 0 && i + 1 < argc){
+            char* end;
+            double pause = strtod(argv[++i], &end);
+            if(*end != '\0' || pause <= 0) usage();
+            vm.gcPauseTarget = pause / 1000;
+        } else if(strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc){
+            char* end;
+            long threads = strtol(argv[++i], &end, 10);
+            if(*end != '\0' || threads < 1 || threads > GC_THREADS_MAX){
+                usage();
+            }
+            vm.gcThreads = (int)threads;
+        } else if(strcmp(argv[i], "--gc-stats") == 0){
+            gcStats = true;
+        } else if(strcmp(argv[i], "--gc-initial-heap") == 0 && i + 1 < argc){
+            vm.nextGC = kilobytes(argv[++i]);
+        } else if(strcmp(argv[i], "--gc-heap-grow") == 0 && i + 1 < argc){
+            char* end;
+            double factor = strtod(argv[++i], &end);
+            if(*end != '\0' || factor < 1) usage();
+            vm.gcGrowFactor = factor;
+        } else if(strcmp(argv[i], "--gc-nursery") == 0 && i + 1 < argc){
+            vm.nurserySize = kilobytes(argv[++i]);
+        } else if(strcmp(argv[i], "--gc-keep-temporaries") == 0){
+            vm.freeTemporaries = false;
+        } else if(strcmp(argv[i], "--intern-max") == 0 && i + 1 < argc){
+            char* end;
+            long length = strtol(argv[++i], &end, 10);
+            if(*end != '\0' || length < 0 || length > INT_MAX) usage();
+            vm.internMax = (int)length;
+        } else if(path == NULL && argv[i][0] != '-'){
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
     // runFile("examples/functions/function.viper");
     //runFile("examples/functions/built_in_function.viper");
-    if (argc == 1){
+    int status = 0;
+    if (path == NULL){
         repl(&vm);
-    } else if(argc == 2){
-        runFile(&vm, argv[1]);
     } else {
-        fprintf(stderr, "Usage: viper [path]\n");
-        exit(64);
+        status = runFile(&vm, path);
     }
 
+    if(gcStats) printGCStats();
     freeVM();        
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
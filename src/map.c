@@ -81,6 +81,7 @@ bool mapSet(ObjMap* map, Value key, Value value){
 
     entry->key = key;
     entry->value = value;
+    WRITE_BARRIER(map);
 
     return isNewKey;
 }
@@ -1,25 +1,113 @@
+#include<limits.h>
 #include<stdlib.h>
+#include<string.h>
+#include<time.h>
 
+#include "map.h"
 #include "memory.h"
+#include "slab.h"
+#include "workers.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between two steps of an incremental collection. While
+// sweeping, each step sweeps a single page.
+#define GC_STEP_SIZE (32 * 1024)
 
-void* reallocate( void* pointer, size_t oldSize, size_t newSize ){
-    vm.bytesAllocated += newSize - oldSize;
+// Gray objects blackened or objects swept between two checks of the clock
+#define GC_WORK_UNIT 256
+
+// A full collection asks for a compaction when packing the objects of each
+// size class together would free this many slab pages, and this share of
+// all of them
+#define COMPACT_MIN_PAGES 16
+#define COMPACT_MIN_SHARE 0.25
+
+// How far back from the newest young object freeTemporary looks
+#define TEMPORARY_SEARCH 8
+
+#ifdef DEBUG_STRESS_GC
+// Every allocation runs a minor collection or a single unit of work of a
+// full one, which starts every this many allocations
+#define STRESS_FULL_GC_INTERVAL 8
+// Compactions are asked for every this many allocations
+#define STRESS_COMPACT_INTERVAL 64
+static int stressCount = 0;
+#endif
+
+static void startCycle();
+static void finishSweep();
+static void gcStep();
+static void gcWork(int budget);
+
+// Wall clock time in seconds, pauses are measured with it
+double gcClock(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void recordPause(double start){
+    double pause = gcClock() - start;
+    if(pause > vm.gcMaxPause) vm.gcMaxPause = pause;
+    vm.gcTotalPause += pause;
+    vm.gcPauseCount++;
+}
+
+// Accounts for an allocation of size more bytes and runs whatever part of
+// a collection is due
+static void collectIfNeeded(size_t size){
+    vm.bytesAllocated += size;
+    vm.totalAllocated += size;
+    vm.youngBytes += size;
 
-    if(newSize > oldSize){
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+    if(vm.gcPhase != GC_IDLE){
+        gcWork(1);
+    } else if(++stressCount % STRESS_FULL_GC_INTERVAL == 0){
+        startCycle();
+    }
+    if(stressCount % STRESS_COMPACT_INTERVAL == 0) vm.compactPending = true;
+    collectYoung();
 #endif
+
+    // The next collection is due before the last one got through the heap
+    if(vm.gcPhase == GC_SWEEP && vm.bytesAllocated > vm.nextGC){
+        double start = gcClock();
+        finishSweep();
+        recordPause(start);
     }
 
-    if(vm.bytesAllocated > vm.nextGC){
-        collectGarbage();
+    if(vm.gcPhase != GC_IDLE){
+        vm.gcStepBytes += size;
+        if(vm.gcStepBytes > GC_STEP_SIZE){
+            vm.gcStepBytes = 0;
+            gcStep();
+        }
+    } else if(vm.bytesAllocated > vm.nextGC){
+        double start = gcClock();
+        startCycle();
+        recordPause(start);
+    }
+
+    if(vm.youngBytes > vm.nurserySize && vm.gcPhase != GC_MARK){
+        double start = gcClock();
+        collectYoung();
+        recordPause(start);
+    }
+}
+
+void* reallocate( void* pointer, size_t oldSize, size_t newSize ){
+    // Only collect when growing, freeing from sweep must not re-enter the GC
+    if(newSize > oldSize){
+        collectIfNeeded(newSize - oldSize);
+    } else if(currentWorker != NULL){
+        workerFreeBytes(oldSize - newSize);
+    } else {
+        vm.bytesAllocated -= oldSize - newSize;
     }
 
     if(newSize == 0){
@@ -37,6 +125,46 @@ void* reallocate( void* pointer, size_t oldSize, size_t newSize ){
     return result;
 }
 
+// Allocates without giving the collector a chance to run, for callers
+// holding objects it can't see. The bytes count towards the next one.
+void* allocateUncollected(size_t size){
+    vm.bytesAllocated += size;
+    vm.totalAllocated += size;
+    vm.youngBytes += size;
+
+    void* result = malloc(size);
+    if(result == NULL) exit(1);
+    return result;
+}
+
+// Hands out the slot of a new young object, left uninitialized
+Obj* allocateSlot(size_t size){
+    collectIfNeeded(size);
+
+    if(vm.youngCapacity < vm.youngCount + 1){
+        vm.youngCapacity = GROW_CAPACITY(vm.youngCapacity);
+        vm.youngObjects = (Obj**)realloc(
+            vm.youngObjects,
+            sizeof(Obj*) * vm.youngCapacity
+        );
+
+        if(vm.youngObjects == NULL) exit(1);
+    }
+
+    Obj* object = slabAllocate(size);
+    vm.youngObjects[vm.youngCount++] = object;
+    return object;
+}
+
+void freeSlot(Obj* object, size_t size){
+    if(currentWorker != NULL){
+        workerFreeSlot(object, size);
+        return;
+    }
+    vm.bytesAllocated -= size;
+    slabFree(object, size);
+}
+
 void freeObject(Obj* object){
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*) object, object->type);
@@ -46,64 +174,82 @@ void freeObject(Obj* object){
     switch (object->type){
         case OBJ_INSTANCE:{
             ObjInstance* instance = (ObjInstance*) object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            freeTable(&instance->dictionary);
+            FREE_OBJ(ObjInstance, object);
+            break;
+        }
+
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*) object;
+            freeTable(&shape->transitions);
+            FREE_OBJ(ObjShape, object);
+            break;
+        }
+
+        case OBJ_BUILDER:{
+            ObjBuilder* builder = (ObjBuilder*) object;
+            FREE_ARRAY(char, builder->chars, builder->capacity);
+            FREE_OBJ(ObjBuilder, object);
             break;
         }
 
         case OBJ_CLASS:{
             ObjClass* klass = (ObjClass*) object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            FREE_OBJ(ObjClass, object);
             break;
         }
 
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if(!IS_ROPE(string) && !IS_INLINE(string)){
+                FREE_ARRAY(char, string->chars, string->length + 1);
+            }
+            freeSlot(object, stringSize(string));
             break;
         }
 
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object); 
+            FREE_OBJ(ObjFunction, object); 
             break;
         }
 
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            FREE_OBJ(ObjNative, object);
             break;
         }
 
         case OBJ_CLOSURE:{
             ObjClosure* closure = (ObjClosure*) object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_OBJ(ObjClosure, object);
             break;
         }
 
         case OBJ_UPVALUE:{
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(ObjUpvalue, object);
             break;
         }
 
         case OBJ_BOUND_METHOD:{
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(ObjBoundMethod, object);
             break;
         }
 
         case OBJ_LIST:{
             ObjList* list = (ObjList*)object;
-            freeTable(&list->nativeMethods);
-            FREE(ObjList, object);
+            freeValueArray(&list->array);
+            FREE_OBJ(ObjList, object);
             break;
         }
 
         case OBJ_MAP:{
-            ObjMap* list = (ObjMap*)object;
-            FREE(ObjMap, object);
+            ObjMap* map = (ObjMap*)object;
+            freeMap(map);
+            FREE_OBJ(ObjMap, object);
             break;
         }
 
@@ -114,15 +260,14 @@ void freeObject(Obj* object){
                 file->file = NULL;
                 file->isOpen = false;
             }
-            freeTable(&file->nativeMethods);
-            FREE(ObjFile, object);
+            FREE_OBJ(ObjFile, object);
             break;
         }
 
         case OBJ_BYTE:{
             ObjByte* byte = (ObjByte*) object;
             freeByteArray(&byte->bytes);
-            FREE(ObjByte, object);
+            FREE_OBJ(ObjByte, object);
             break;
         }
 
@@ -130,14 +275,21 @@ void freeObject(Obj* object){
 }
 
 void freeObjects(){
-    Obj* object = vm.objects;
-    while(object != NULL){
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        for(SlabPage* page = vm.pages[i]; page != NULL; page = page->next){
+            for(int j = 0; j < page->slotCount; j++){
+                Obj* object = SLAB_SLOT(page, j);
+                if(!object->isFree) freeObject(object);
+            }
+        }
     }
+    freeSlabs();
+
+    freeWorkers();
 
+    free(vm.youngObjects);
     free(vm.grayStack);
+    free(vm.remembered);
 }
 
 
@@ -145,7 +297,14 @@ void freeObjects(){
 
 void markObject(Obj* object){
     if(object==NULL) return;
-    if (object->isMarked) return;
+    // A minor collection doesn't trace the old generation, young objects
+    // it points to are found through the remembered set
+    if(vm.minorGC && object->isOld) return;
+    if(currentWorker != NULL){
+        workerMark(object);
+        return;
+    }
+    if(IS_MARKED(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*) object);
@@ -153,7 +312,7 @@ void markObject(Obj* object){
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    SET_MARKED(object);
 
     if(vm.grayCapacity < vm.grayCount + 1){
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -169,6 +328,21 @@ void markObject(Obj* object){
     vm.grayStack[vm.grayCount++] = object;
 }
 
+void rememberObject(Obj* object){
+    if(vm.rememberedCapacity < vm.rememberedCount + 1){
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(
+            vm.remembered,
+            sizeof(Obj*) * vm.rememberedCapacity
+        );
+
+        if(vm.remembered == NULL) exit(1);
+    }
+
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
 void markValue(Value value){
     if(IS_OBJ(value)) markObject(AS_OBJ(value));
 }
@@ -195,15 +369,6 @@ void markMap(ObjMap* map){
     }
 }
 
-void tableRemoveWhite(Table* table){
-    for(int i=0 ; i < table->capacity; i++){
-        Entry* entry = &table->entires[i];
-        if(entry->key != NULL && !entry->key->obj.isMarked){
-            tableDelete(table, entry->key);
-        }
-    }
-}
-
 void markRoots(){
     for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
         markValue(*slot);
@@ -220,7 +385,15 @@ void markRoots(){
         markObject((Obj*) upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalNames);
+    markArray(&vm.globalValues);
+    markTable(&vm.listMethods);
+    markTable(&vm.fileMethods);
+    markTable(&vm.builderMethods);
+    markTable(&vm.stringMethods);
+    for(int i = 0; i < NUMBER_STRING_CACHE; i++){
+        markObject((Obj*) vm.numberStrings[i]);
+    }
     markCompilerRoots(&vm);
 }
 
@@ -245,6 +418,13 @@ void blackendObject(Obj* object){
             ObjFunction* function = (ObjFunction*) object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // Keep cached shapes alive so a new shape can't reuse the
+            // address of one a cache still points to
+            for(int i = 0; i < function->chunk.cacheCount; i++){
+                markObject((Obj*) function->chunk.caches[i].shape);
+                markObject((Obj*) function->chunk.caches[i].transition);
+                markValue(function->chunk.caches[i].method);
+            }
             break;
         }
 
@@ -255,15 +435,30 @@ void blackendObject(Obj* object){
 
         case OBJ_CLASS:{
             ObjClass* kclass = (ObjClass*) object;
-            markObject((Obj*)kclass);
+            markObject((Obj*)kclass->name);
             markTable(&kclass->methods);
+            markObject((Obj*)kclass->rootShape);
             break;
         }
 
         case OBJ_INSTANCE:{
             ObjInstance* instance = (ObjInstance*) object;
             markObject((Obj*) instance->kclass);
-            markTable(&instance->fields);
+            if(instance->shape != NULL){
+                markObject((Obj*) instance->shape);
+                for(int i = 0; i < instance->shape->fieldCount; i++){
+                    markValue(instance->fields[i]);
+                }
+            }
+            markTable(&instance->dictionary);
+            break;
+        }
+
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*) object;
+            markObject((Obj*) shape->parent);
+            markObject((Obj*) shape->key);
+            markTable(&shape->transitions);
             break;
         }
 
@@ -281,71 +476,668 @@ void blackendObject(Obj* object){
         }
 
         case OBJ_MAP:{
-            ObjMap* map = (ObjMap*) map;
+            ObjMap* map = (ObjMap*) object;
             markMap(map);
             break;
         }
 
+        case OBJ_FILE:{
+            ObjFile* file = (ObjFile*) object;
+            markObject((Obj*) file->path);
+            markObject((Obj*) file->mode);
+            break;
+        }
+
+        case OBJ_STRING:{
+            ObjString* string = (ObjString*) object;
+            if(IS_ROPE(string)){
+                markObject((Obj*) string->left);
+                markObject((Obj*) string->right);
+            }
+            break;
+        }
+
         case OBJ_NATIVE:
-        case OBJ_STRING:
+        case OBJ_BYTE:
+        case OBJ_BUILDER:
             break;
     }
 }
 
 void traceReferences(){
+    if(vm.gcThreads > 1 && !vm.minorGC){
+        parallelTrace(0);
+        return;
+    }
+
     while(vm.grayCount > 0){
         Obj* object = vm.grayStack[--vm.grayCount];
         blackendObject(object);
     }
 }
 
-void sweep(){
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+// The intern table doesn't keep strings alive, each dead one is dropped from
+// it when swept so it is never scanned as a whole
+static void freeUnreached(Obj* object){
+    if(object->type == OBJ_STRING && ((ObjString*) object)->interned){
+        internRemove(&vm.strings, (ObjString*) object);
+    }
+    freeObject(object);
+}
 
-    while(object != NULL){
-        if(object->isMarked){
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj* unreached = object;
-            object = object->next;
-            if(previous != NULL){
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+// Frees an object the interpreter knows to be unreachable, as long as it
+// is among the newest young objects. An older or marked one may already be
+// known to the collector, so it is left for the next collection.
+void freeTemporary(Obj* object){
+    int oldest = vm.youngCount - TEMPORARY_SEARCH;
+    if(oldest < 0) oldest = 0;
+
+    for(int i = vm.youngCount - 1; i >= oldest; i--){
+        if(vm.youngObjects[i] != object) continue;
+        if(IS_MARKED(object)) return;
+
+        vm.youngObjects[i] = vm.youngObjects[--vm.youngCount];
+        size_t before = vm.bytesAllocated;
+        freeUnreached(object);
+        size_t freed = before - vm.bytesAllocated;
+        vm.youngBytes = vm.youngBytes > freed ? vm.youngBytes - freed : 0;
+        vm.temporariesFreed++;
+        return;
+    }
+}
 
-            freeObject(unreached);
-            
+static void freeSwept(Obj* object){
 #ifdef DEBUG_LOG_GC
-            printf("%p Swepped ", (void*)unreached);
-            printValue(OBJ_VAL(unreached));
-            printf("\n");
+    printf("%p Swepped ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
 #endif
 
+    freeUnreached(object);
+}
+
+// Frees unreached young objects and promotes the survivors. While a full
+// collection sweeps, it would take promoted objects on pages not swept yet
+// for unreached old ones, so survivors stay young until the next time.
+void sweepYoung(){
+    bool promote = vm.gcPhase != GC_SWEEP;
+    int kept = 0;
+
+    for(int i = 0; i < vm.youngCount; i++){
+        Obj* object = vm.youngObjects[i];
+        if(!IS_MARKED(object)){
+            freeSwept(object);
+            continue;
+        }
+
+        CLEAR_MARKED(object);
+        if(promote){
+            object->isOld = true;
+        } else {
+            vm.youngObjects[kept++] = object;
         }
     }
+
+    vm.youngCount = kept;
 }
 
-void collectGarbage(){
+// Marks what remembered objects point to. A minor collection traces every
+// one of them, a full one only those written after being marked. After
+// the collection every survivor is old, so the set starts empty again,
+// unless survivors had to stay young.
+void traceRemembered(){
+    bool keep = vm.minorGC && vm.gcPhase == GC_SWEEP;
+
+    for(int i = 0; i < vm.rememberedCount; i++){
+        Obj* object = vm.remembered[i];
+        if(vm.minorGC || IS_MARKED(object)) blackendObject(object);
+        if(!keep) object->isRemembered = false;
+    }
+    if(!keep) vm.rememberedCount = 0;
+}
+
+// Minor collection: traces only young objects, reached from the roots and
+// the remembered set, and promotes the survivors. It waits for a running
+// full collection to finish marking, which traces the young objects too.
+void collectYoung(){
+    if(vm.gcPhase == GC_MARK) return;
+
 #ifdef DEBUG_LOG_GC
-    printf("-- GC BEGIN\n");
+    printf("-- minor GC BEGIN\n");
     size_t before = vm.bytesAllocated;
 #endif
 
+    vm.gcMinorCount++;
+    vm.minorGC = true;
     markRoots();
+    traceRemembered();
     traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    sweepYoung();
+    vm.minorGC = false;
+
+    vm.youngBytes = 0;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor GC END\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+/*
+Full collections are incremental. Marking starts from the roots and then
+blackens a bounded number of gray objects per step, interleaved with the
+program. The write barrier remembers every marked object that is written
+to, so once the gray stack runs empty the roots and those objects are
+traced again in one final pause before anything is swept.
+
+Sweeping is lazy and out of the pauses. Once marking finishes every young
+object joins the old generation and every page is left to sweep. A size
+class out of free slots sweeps its own pages until one frees a slot, and
+every step sweeps one more page so the sweep finishes in time. Sweeping a
+page frees its unmarked old objects then clears its mark bits, so
+survivors are never written to. Objects allocated meanwhile are young, so
+sweeping skips them, and minor collections may run again. Live objects on
+pages not swept yet are still marked, so a minor collection doesn't trace
+them and the write barrier remembers them. Unmarked strings the program
+interns again meanwhile are marked back to life (see copyString).
+*/
+
+static void startCycle(){
+#ifdef DEBUG_LOG_GC
+    printf("-- GC BEGIN\n");
+#endif
+
+    vm.gcPhase = GC_MARK;
+    vm.gcStepBytes = 0;
+    markRoots();
+}
+
+// Whether the slab pages are emptier than a compaction is worth
+static bool fragmented(){
+    int pages = 0;
+    int spare = 0;
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        int classPages = 0;
+        int slotCount = 0;
+        int usedSlots = 0;
+        for(SlabPage* page = vm.pages[i]; page != NULL; page = page->next){
+            classPages++;
+            slotCount = page->slotCount;
+            usedSlots += page->usedSlots;
+        }
+        if(classPages == 0) continue;
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+        pages += classPages;
+        spare += classPages - (usedSlots + slotCount - 1) / slotCount;
+    }
+    return spare >= COMPACT_MIN_PAGES && spare >= pages * COMPACT_MIN_SHARE;
+}
+
+static void finishCycle(){
+    vm.liveBytes = vm.markedBytes - vm.sweptBytes;
+    vm.nextGC = vm.liveBytes * vm.gcGrowFactor;
+    vm.gcPhase = GC_IDLE;
+    vm.gcFullCount++;
+    if(fragmented()) vm.compactPending = true;
 
 #ifdef DEBUG_LOG_GC
     printf("-- GC END\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
+    printf("   %zu bytes live, next at %zu\n", vm.liveBytes, vm.nextGC);
 #endif
-}
\ No newline at end of file
+}
+
+static void finishMarking(){
+    markRoots();
+    traceRemembered();
+    traceReferences();
+
+    // The unmarked ones are freed with the old objects
+    for(int i = 0; i < vm.youngCount; i++){
+        vm.youngObjects[i]->isOld = true;
+    }
+    vm.youngCount = 0;
+    vm.youngBytes = 0;
+
+    // Objects allocated from now on are left for the next collection
+    vm.unsweptPages = 0;
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        vm.sweepPages[i] = vm.pages[i];
+        for(SlabPage* page = vm.pages[i]; page != NULL; page = page->next){
+            page->swept = false;
+            vm.unsweptPages++;
+        }
+    }
+
+    // Until the sweep tells how much of it is live
+    vm.markedBytes = vm.bytesAllocated;
+    vm.sweptBytes = 0;
+    vm.nextGC = vm.markedBytes * vm.gcGrowFactor;
+
+    vm.gcPhase = GC_SWEEP;
+    if(vm.unsweptPages == 0) finishCycle();
+}
+
+void sweepPage(int sizeClass){
+    SlabPage* page = vm.sweepPages[sizeClass];
+    vm.sweepPages[sizeClass] = page->next;
+
+    size_t before = vm.bytesAllocated;
+    for(int i = 0; i < page->slotCount; i++){
+        Obj* object = SLAB_SLOT(page, i);
+        if(!object->isFree && object->isOld && !IS_MARKED(object)){
+            freeSwept(object);
+        }
+    }
+    memset(page->marks, 0, sizeof(page->marks));
+    page->swept = true;
+    vm.sweptBytes += before - vm.bytesAllocated;
+
+    if(--vm.unsweptPages == 0) finishCycle();
+}
+
+static void sweepNextPage(){
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        if(vm.sweepPages[i] != NULL){
+            sweepPage(i);
+            return;
+        }
+    }
+}
+
+// Does up to budget objects worth of the running collection, or a page
+// while sweeping
+static void gcWork(int budget){
+    switch(vm.gcPhase){
+        case GC_IDLE:
+            break;
+
+        case GC_MARK:
+            while(vm.grayCount > 0 && budget-- > 0){
+                blackendObject(vm.grayStack[--vm.grayCount]);
+            }
+            if(vm.grayCount == 0) finishMarking();
+            break;
+
+        case GC_SWEEP:
+            sweepNextPage();
+            break;
+    }
+}
+
+static void finishSweep(){
+    if(vm.gcThreads > 1){
+        if(parallelSweep(0)) finishCycle();
+        return;
+    }
+    while(vm.gcPhase == GC_SWEEP){
+        sweepNextPage();
+    }
+}
+
+// Same as gcWork with every GC thread, until the deadline if there is one
+static void gcParallelWork(double deadline){
+    switch(vm.gcPhase){
+        case GC_IDLE:
+            break;
+
+        case GC_MARK:
+            if(parallelTrace(deadline)) finishMarking();
+            break;
+
+        case GC_SWEEP:
+            if(parallelSweep(deadline)) finishCycle();
+            break;
+    }
+}
+
+// One pause of the running collection, kept to about the pause target
+static void gcStep(){
+    double start = gcClock();
+    double deadline = start + vm.gcPauseTarget;
+
+    do {
+        if(vm.gcThreads > 1){
+            gcParallelWork(deadline);
+        } else {
+            gcWork(GC_WORK_UNIT);
+        }
+    } while(vm.gcPhase == GC_MARK && gcClock() < deadline);
+
+    recordPause(start);
+}
+
+// Finishes the running full collection, or does a whole one, at once
+void collectGarbage(){
+    if(vm.gcPhase == GC_IDLE) startCycle();
+    while(vm.gcPhase != GC_IDLE){
+        if(vm.gcThreads > 1){
+            gcParallelWork(0);
+        } else {
+            gcWork(INT_MAX);
+        }
+    }
+}
+
+/*
+Compaction packs the objects of each size class on as few slab pages as
+possible, so the pages a long running program no longer fills go back to
+the system. It moves the objects off the emptiest pages into free slots of
+the others, leaving the new address behind in the old slot, then rewrites
+every reference to them: in the roots, the intern table, the collector's
+own lists and the fields of every object. Only the interpreter knows when
+no C code holds an object pointer of its own, so compactHeap() runs at its
+safepoints once vm.compactPending is set, by a full collection leaving
+enough of the pages empty or by gc_compact().
+*/
+
+// What is left in the slot of an object moved off an evacuated page
+typedef struct {
+    Obj obj;
+    Obj* to;
+} ForwardedObj;
+
+Obj* forwardObject(Obj* object){
+    if(object == NULL || !SLAB_PAGE(object)->evacuated) return object;
+    return ((ForwardedObj*)object)->to;
+}
+
+#define FORWARD(pointer) ((pointer) = (void*)forwardObject((Obj*)(pointer)))
+
+static void forwardValue(Value* value){
+    if(IS_OBJ(*value)) *value = OBJ_VAL(forwardObject(AS_OBJ(*value)));
+}
+
+static void forwardArray(ValueArray* array){
+    for(int i = 0; i < array->count; i++){
+        forwardValue(&array->values[i]);
+    }
+}
+
+// Keys keep their hash when they move, so entries stay where they are
+static void forwardTable(Table* table){
+    for(int i = 0; i < table->capacity; i++){
+        Entry* entry = &table->entires[i];
+        FORWARD(entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+static void forwardMap(ObjMap* map){
+    for(int i = 0; i < map->capacity; i++){
+        MapEntry* entry = &map->entries[i];
+        forwardValue(&entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+static void forwardObjects(Obj** objects, int count){
+    for(int i = 0; i < count; i++){
+        FORWARD(objects[i]);
+    }
+}
+
+static void forwardRoots(){
+    for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
+        forwardValue(slot);
+    }
+
+    for(int i = 0; i < vm.frameCount; i++){
+        FORWARD(vm.frames[i].closure);
+    }
+
+    FORWARD(vm.openUpvalues);
+
+    forwardTable(&vm.globalNames);
+    forwardArray(&vm.globalValues);
+    internForward(&vm.strings);
+    forwardTable(&vm.listMethods);
+    forwardTable(&vm.fileMethods);
+    forwardTable(&vm.builderMethods);
+    forwardTable(&vm.stringMethods);
+    for(int i = 0; i < NUMBER_STRING_CACHE; i++){
+        FORWARD(vm.numberStrings[i]);
+    }
+    forwardCompilerRoots(&vm);
+
+    forwardObjects(vm.youngObjects, vm.youngCount);
+    forwardObjects(vm.remembered, vm.rememberedCount);
+}
+
+// Same walk as blackendObject(), rewriting each reference
+static void forwardFields(Obj* object){
+    switch (object->type){
+        case OBJ_CLOSURE:{
+            ObjClosure* closure = (ObjClosure*) object;
+            FORWARD(closure->function);
+            for(int i = 0; i < closure->upvalueCount; i++){
+                FORWARD(closure->upvalues[i]);
+            }
+            break;
+        }
+
+        case OBJ_FUNCTION:{
+            ObjFunction* function = (ObjFunction*) object;
+            FORWARD(function->name);
+            forwardArray(&function->chunk.constants);
+            for(int i = 0; i < function->chunk.cacheCount; i++){
+                FORWARD(function->chunk.caches[i].shape);
+                FORWARD(function->chunk.caches[i].transition);
+                forwardValue(&function->chunk.caches[i].method);
+            }
+            break;
+        }
+
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*) object;
+            forwardValue(&upvalue->closed);
+            FORWARD(upvalue->next);
+            break;
+        }
+
+        case OBJ_CLASS:{
+            ObjClass* kclass = (ObjClass*) object;
+            FORWARD(kclass->name);
+            forwardTable(&kclass->methods);
+            FORWARD(kclass->rootShape);
+            break;
+        }
+
+        case OBJ_INSTANCE:{
+            ObjInstance* instance = (ObjInstance*) object;
+            FORWARD(instance->kclass);
+            if(instance->shape != NULL){
+                FORWARD(instance->shape);
+                for(int i = 0; i < instance->shape->fieldCount; i++){
+                    forwardValue(&instance->fields[i]);
+                }
+            }
+            forwardTable(&instance->dictionary);
+            break;
+        }
+
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*) object;
+            FORWARD(shape->parent);
+            FORWARD(shape->key);
+            forwardTable(&shape->transitions);
+            break;
+        }
+
+        case OBJ_BOUND_METHOD:{
+            ObjBoundMethod* bound = (ObjBoundMethod*) object;
+            forwardValue(&bound->receiver);
+            FORWARD(bound->method);
+            break;
+        }
+
+        case OBJ_LIST:{
+            ObjList* list = (ObjList*) object;
+            forwardArray(&list->array);
+            break;
+        }
+
+        case OBJ_MAP:{
+            ObjMap* map = (ObjMap*) object;
+            forwardMap(map);
+            break;
+        }
+
+        case OBJ_FILE:{
+            ObjFile* file = (ObjFile*) object;
+            FORWARD(file->path);
+            FORWARD(file->mode);
+            break;
+        }
+
+        case OBJ_STRING:{
+            ObjString* string = (ObjString*) object;
+            if(IS_ROPE(string)){
+                FORWARD(string->left);
+                FORWARD(string->right);
+            }
+            break;
+        }
+
+        case OBJ_NATIVE:
+        case OBJ_BYTE:
+        case OBJ_BUILDER:
+            break;
+    }
+}
+
+static void moveObject(Obj* object, int slotSize){
+    Obj* to = slabAllocate(slotSize);
+    memcpy(to, object, slotSize);
+
+    // A closed upvalue points to its own copy of the value, and a short
+    // string to its own characters
+    if(object->type == OBJ_UPVALUE){
+        ObjUpvalue* upvalue = (ObjUpvalue*) object;
+        if(upvalue->location == &upvalue->closed){
+            ((ObjUpvalue*) to)->location = &((ObjUpvalue*) to)->closed;
+        }
+    } else if(object->type == OBJ_STRING){
+        ObjString* string = (ObjString*) object;
+        if(IS_INLINE(string)){
+            ((ObjString*) to)->chars = ((ObjString*) to)->inlined;
+        }
+    }
+
+    ((ForwardedObj*) object)->to = to;
+}
+
+// Compacts the heap, finishing the running collection first. Only safe
+// where no object pointer is held outside the VM's own state.
+void compactHeap(){
+    double start = gcClock();
+    if(vm.gcPhase != GC_IDLE) collectGarbage();
+    vm.compactPending = false;
+    vm.gcCompactCount++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compaction BEGIN\n");
+#endif
+
+    int evacuated = 0;
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        evacuated += slabEvacuate(i);
+    }
+
+    if(evacuated > 0){
+        for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+            for(SlabPage* page = vm.pages[i]; page != NULL; page = page->next){
+                if(!page->evacuated) continue;
+                for(int j = 0; j < page->slotCount; j++){
+                    Obj* object = SLAB_SLOT(page, j);
+                    if(!object->isFree) moveObject(object, page->slotSize);
+                }
+            }
+        }
+
+        forwardRoots();
+        for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+            for(SlabPage* page = vm.pages[i]; page != NULL; page = page->next){
+                if(page->evacuated) continue;
+                for(int j = 0; j < page->slotCount; j++){
+                    Obj* object = SLAB_SLOT(page, j);
+                    if(!object->isFree) forwardFields(object);
+                }
+            }
+        }
+
+        for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+            slabRelease(i);
+        }
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compaction END\n");
+    printf("   released %d pages\n", evacuated);
+#endif
+
+    recordPause(start);
+}
+
+/* Statistics */
+
+static const char* objectCountNames[] = {
+    [OBJ_STRING]        = "string_objects",
+    [OBJ_FUNCTION]      = "function_objects",
+    [OBJ_NATIVE]        = "native_objects",
+    [OBJ_CLOSURE]       = "closure_objects",
+    [OBJ_UPVALUE]       = "upvalue_objects",
+    [OBJ_CLASS]         = "class_objects",
+    [OBJ_INSTANCE]      = "instance_objects",
+    [OBJ_BOUND_METHOD]  = "bound_method_objects",
+    [OBJ_LIST]          = "list_objects",
+    [OBJ_MAP]           = "map_objects",
+    [OBJ_FILE]          = "file_objects",
+    [OBJ_BYTE]          = "byte_objects",
+    [OBJ_SHAPE]         = "shape_objects",
+    [OBJ_BUILDER]       = "builder_objects",
+};
+
+#define OBJ_TYPE_COUNT (sizeof(objectCountNames) / sizeof(objectCountNames[0]))
+
+// Fills stats with the collector's counters, times in milliseconds, and
+// returns how many there are. Objects are counted by type over the whole
+// heap, garbage not collected yet included.
+int gcStats(GCStat* stats){
+    int count = 0;
+    #define STAT(statName, statValue) \
+        do { \
+            stats[count].name = (statName); \
+            stats[count++].value = (double)(statValue); \
+        } while (false)
+
+    STAT("full_collections", vm.gcFullCount);
+    STAT("minor_collections", vm.gcMinorCount);
+    STAT("compactions", vm.gcCompactCount);
+    STAT("temporaries_freed", vm.temporariesFreed);
+    STAT("pauses", vm.gcPauseCount);
+    STAT("total_pause_ms", vm.gcTotalPause * 1000);
+    STAT("max_pause_ms", vm.gcMaxPause * 1000);
+    STAT("bytes_allocated", vm.totalAllocated);
+    STAT("bytes_freed", vm.totalAllocated - vm.bytesAllocated);
+    STAT("heap_bytes", vm.bytesAllocated);
+    STAT("live_bytes", vm.liveBytes);
+    STAT("interned_strings", vm.strings.count);
+    STAT("intern_buckets", vm.strings.capacity);
+
+    int objects[OBJ_TYPE_COUNT] = {0};
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        for(SlabPage* page = vm.pages[i]; page != NULL; page = page->next){
+            for(int j = 0; j < page->slotCount; j++){
+                Obj* object = SLAB_SLOT(page, j);
+                if(!object->isFree) objects[object->type]++;
+            }
+        }
+    }
+    for(size_t i = 0; i < OBJ_TYPE_COUNT; i++){
+        STAT(objectCountNames[i], objects[i]);
+    }
+
+    #undef STAT
+    return count;
+}
@@ -4,6 +4,23 @@
 #include "common.h"
 #include "compiler.h"
 #include "object.h"
+#include "slab.h"
+
+// Default time a single incremental GC step may take, in seconds
+#define GC_PAUSE_TARGET 0.001
+
+// Defaults of the heap size that starts the first full collection, of how
+// much the heap may grow over what the last one left live, and of the
+// bytes allocated between two minor collections
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+#define NURSERY_SIZE (256 * 1024)
+
+// Room for everything gcStats() reports
+#define GC_STATS_MAX 32
+
+// Most threads a collection may use, the main one included
+#define GC_THREADS_MAX 64
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type)*(count))
@@ -17,12 +34,46 @@
 
 #define FREE(type, pointer)     reallocate(pointer, sizeof(type), 0)
 
+#define FREE_OBJ(type, object)  freeSlot((Obj*)(object), sizeof(type))
+
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Must follow every store of a reference into an existing object, before
+// anything else is allocated. An old object that may now point to young
+// ones is remembered, so the next minor collection traces it. So is an
+// object already marked by an incremental collection, which rescans it
+// before sweeping.
+#define WRITE_BARRIER(object) \
+    do { \
+        Obj* barrierObject = (Obj*)(object); \
+        if(!barrierObject->isRemembered && \
+            (barrierObject->isOld || IS_MARKED(barrierObject))){ \
+            rememberObject(barrierObject); \
+        } \
+    } while(false)
+
+typedef struct {
+    const char* name;
+    double value;
+} GCStat;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateUncollected(size_t size);
+Obj* allocateSlot(size_t size);
+void freeSlot(Obj* object, size_t size);
 void freeObjects();
 void collectGarbage();
+void collectYoung();
+void sweepPage(int sizeClass);
+void compactHeap();
+Obj* forwardObject(Obj* object);
+void freeObject(Obj* object);
+void freeTemporary(Obj* object);
 void markObject(Obj* object);
+void blackendObject(Obj* object);
+double gcClock();
+int gcStats(GCStat* stats);
+void rememberObject(Obj* object);
 
 #endif
\ No newline at end of file
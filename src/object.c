@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "file.h"
@@ -19,36 +20,62 @@ bool isObjType(Value value, ObjType type){
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Interns the string unless it is too long, the hash is only needed then.
+// Up to STRING_INLINE_MAX chars are copied into the object, a longer
+// string takes chars over.
 ObjString* allocateString(char* chars, int length, uint32_t hash){
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    bool inlined = length <= STRING_INLINE_MAX;
+    size_t size = inlined ? offsetof(ObjString, inlined) + length + 1
+                          : sizeof(ObjString);
+    ObjString* string = (ObjString*)allocateObject(size, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    if(inlined){
+        memcpy(string->inlined, chars, length);
+        string->inlined[length] = '\0';
+        string->chars = string->inlined;
+    } else {
+        string->chars = chars;
+    }
+    string->right = NULL;
+    string->inRope = false;
     string->hash = hash;
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NULL_VAL);
-    pop();
+    string->interned = length <= vm.internMax;
+    if(string->interned) internAdd(&vm.strings, string);
     return string;
 }
 
-// Hash Function: FNV-1a
-uint32_t hashString(const char* key, int length){
-    uint32_t hash = 2166136261u;
-    for(int i=0;i<length;i++){
-        hash ^= (uint32_t) key[i];
-        hash *= 16777619; 
+// An unmarked old string found on a page the running collection has yet
+// to sweep is garbage about to be freed, using it again keeps it alive
+static ObjString* internedString(ObjString* string){
+    if(string != NULL && vm.gcPhase == GC_SWEEP && string->obj.isOld
+            && !SLAB_PAGE(string)->swept){
+        SET_MARKED(string);
     }
-    return hash;
+
+    // Handed out again, the newest concatenation isn't the stack's alone
+    if(string != NULL && string == vm.freshString) vm.freshString = NULL;
+    return string;
 }
 
-ObjString* copyString(const char* chars, int length){
-    uint32_t hash = hashString(chars, length);
+// The interned string equal to chars, if short enough to be interned.
+// Sets hash for allocateString either way.
+ObjString* findInterned(const char* chars, int length, uint32_t* hash){
+    *hash = 0;
+    if(length > vm.internMax) return NULL;
 
-    // Cache string object and re-use
-    ObjString* interned = tableFindString(
-        &vm.strings, chars, length, hash
-    );
+    *hash = hashString(chars, length);
+    return internedString(internFind(&vm.strings, chars, length, *hash));
+}
+
+ObjString* copyString(const char* chars, int length){
+    uint32_t hash;
+    ObjString* interned = findInterned(chars, length, &hash);
     if(interned != NULL) return interned;
 
+    if(length <= STRING_INLINE_MAX){
+        return allocateString((char*)chars, length, hash);
+    }
+
     char* heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
@@ -81,12 +108,10 @@ void printBytes(ObjByte* bytes){
 }
 
 Obj* allocateObject(size_t size, ObjType type){
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocateSlot(size);
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isOld = false;
+    object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -98,6 +123,7 @@ Obj* allocateObject(size_t size, ObjType type){
 ObjFunction* newFunction(){
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity=0;
+    function->maxStack = 0;
     function->name = NULL;
     function->upvalueCount = 0;
     initChunk(&function->chunk);
@@ -193,6 +219,16 @@ void printObject(Value value){
             break;
         }
 
+        case OBJ_SHAPE:{
+            printf("<shape %d>", AS_SHAPE(value)->fieldCount);
+            break;
+        }
+
+        case OBJ_BUILDER:{
+            printf("<builder>");
+            break;
+        }
+
         case OBJ_FILE:{
             ObjFile* file = AS_FILE(value);
             printf(
@@ -208,18 +244,98 @@ void printObject(Value value){
 }
 
 ObjString* takeString(char* chars, int length){
-    uint32_t hash = hashString(chars, length);
+    uint32_t hash;
+    ObjString* string = findInterned(chars, length, &hash);
+    if(string == NULL) string = allocateString(chars, length, hash);
 
-    // Cache string object and re-use
-    ObjString* interned = tableFindString(
-        &vm.strings, chars, length, hash
-    );
-    if(interned != NULL){
+    // Unless the string kept the buffer, it holds a copy or is an older one
+    if(string->chars != chars){
         FREE_ARRAY(char, chars, length + 1);
-        return interned;
     }
+    return string;
+}
 
-    return allocateString(chars, length, hash);
+// Joins two strings without copying them, left to the caller to keep
+// reachable while the rope is allocated
+ObjString* newRope(ObjString* left, ObjString* right){
+    ObjString* rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    rope->length = left->length + right->length;
+    rope->hash = 0;
+    rope->left = left;
+    rope->right = right;
+    rope->interned = false;
+    rope->inRope = false;
+    left->inRope = true;
+    right->inRope = true;
+    return rope;
+}
+
+// Copies the characters of a rope into a buffer of its own, the halves are
+// left to the collector. Pieces are copied from the last one backwards so
+// only left halves wait on the stack of pending nodes, which stays short
+// for ropes grown by appending. Nothing is collected meanwhile, strings
+// are flattened where callers hold others the collector can't see.
+void flattenString(ObjString* rope){
+    char* chars = allocateUncollected(rope->length + 1);
+    chars[rope->length] = '\0';
+
+    ObjString** pending = NULL;
+    int pendingCount = 0;
+    int pendingCapacity = 0;
+
+    int end = rope->length;
+    ObjString* node = rope;
+    for(;;){
+        if(IS_ROPE(node)){
+            if(pendingCapacity < pendingCount + 1){
+                pendingCapacity = GROW_CAPACITY(pendingCapacity);
+                pending = realloc(pending, sizeof(ObjString*) * pendingCapacity);
+                if(pending == NULL) exit(1);
+            }
+            pending[pendingCount++] = node->left;
+            node = node->right;
+            continue;
+        }
+
+        end -= node->length;
+        memcpy(chars + end, node->chars, node->length);
+        if(pendingCount == 0) break;
+        node = pending[--pendingCount];
+    }
+    free(pending);
+
+    rope->chars = chars;
+    rope->right = NULL;
+}
+
+// Ropes read their halves only when flattened, so before a half changes in
+// place the ropes pointing to it are given a copy of its current characters
+// instead. They are found by walking the pages ropes are allocated from.
+// Ropes a running collection found unreachable are skipped, the barrier
+// would trace them into halves that may be freed already. Called after the
+// half left the intern table, or the copy would be the half itself.
+void unshareRopeHalf(ObjString* half){
+    ObjString* copy = copyString(stringChars(half), half->length);
+    copy->inRope = true;
+
+    int sizeClass = SLAB_CLASS(sizeof(ObjString));
+    for(SlabPage* page = vm.pages[sizeClass]; page != NULL; page = page->next){
+        bool unswept = vm.gcPhase == GC_SWEEP && !page->swept;
+        for(int i = 0; i < page->slotCount; i++){
+            Obj* object = SLAB_SLOT(page, i);
+            if(object->isFree || object->type != OBJ_STRING) continue;
+            if(unswept && object->isOld && !IS_MARKED(object)) continue;
+
+            ObjString* rope = (ObjString*)object;
+            if(!IS_ROPE(rope) || (rope->left != half && rope->right != half)){
+                continue;
+            }
+            if(rope->left == half) rope->left = copy;
+            if(rope->right == half) rope->right = copy;
+            WRITE_BARRIER(rope);
+        }
+    }
+    half->inRope = false;
 }
 
 ObjNative* newNative(NativeFn function){
@@ -260,10 +376,25 @@ ObjUpvalue* newObjUpvalue(Value* slot){
     return upvalue;
 }
 
+ObjShape* newShape(ObjShape* parent, ObjString* key){
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->key = key;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
 ObjClass* newClass(ObjString* name){
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->rootShape = NULL;
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    WRITE_BARRIER(klass);
+    pop();
     return klass;
 }
 
@@ -271,7 +402,10 @@ ObjClass* newClass(ObjString* name){
 ObjInstance* newInstance(ObjClass* klass){
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->kclass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    initTable(&instance->dictionary);
     return instance;
 }
 
@@ -287,8 +421,6 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method){
 ObjList* newList(){
     ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
     initValueArray(&list->array);
-    initTable(&list->nativeMethods);
-    initListNativeMethods(list);
     return list;
 }
 
@@ -298,10 +430,19 @@ ObjMap* newMap(){
     return map;
 }
 
+ObjBuilder* newBuilder(){
+    ObjBuilder* builder = ALLOCATE_OBJ(ObjBuilder, OBJ_BUILDER);
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    return builder;
+}
+
+// Path and mode are handed to libc as they are
 ObjFile* newFile(ObjString* path, ObjString* mode){
+    if(IS_ROPE(path)) flattenString(path);
+    if(IS_ROPE(mode)) flattenString(mode);
     ObjFile* file = ALLOCATE_OBJ(ObjFile, OBJ_FILE);
-    initTable(&file->nativeMethods);
-    initFileNativeMethods(file);
     file->mode = mode;
     file->path = path;
     file->isOpen = false;
@@ -331,7 +472,7 @@ ObjString* sprintList(ObjList* list){
     char *result = "[";
     int total = list->array.count;
     for(int i = 0; i < total; i++){
-        result = concat(result, strValue(list->array.values[i])->chars);
+        result = concat(result, stringChars(strValue(list->array.values[i])));
 
         if(i != total-1){
             result = concat(result, ", ");
@@ -355,9 +496,9 @@ ObjString* sprintMap(ObjMap* map){
     for(int i = 0; i < map->capacity; i++){
         if(!IS_NULL(map->entries[i].key)){
             MapEntry entry = map->entries[i];
-            result = concat(result, strValue(entry.key)->chars);
+            result = concat(result, stringChars(strValue(entry.key)));
             result = concat(result, ":");
-            result = concat(result, strValue(entry.value)->chars);
+            result = concat(result, stringChars(strValue(entry.value)));
             count--;
 
             if(count!=0){
@@ -408,11 +549,9 @@ char *appendString(char *old, char *new_str) {
 ObjString* sprintByte(ObjByte* bytes){
     char *str = strdup("(");
     for (int i = 0; i < bytes->bytes.count; i++) {
-        char *chars = ALLOCATE(char, snprintf(NULL, 0, "0x%x", bytes->bytes.byte[i]));
-        if (chars != NULL) {
-            sprintf(chars, "0x%x", bytes->bytes.byte[i]);
-            str = appendString(str, chars);
-        }
+        char chars[8];
+        snprintf(chars, sizeof(chars), "0x%x", bytes->bytes.byte[i]);
+        str = appendString(str, chars);
 
         if (i != bytes->bytes.count - 1) {
             str = appendString(str, ", ");
@@ -468,14 +607,27 @@ ObjString* strObject(Value obj){
         case OBJ_MAP:
             return sprintMap(AS_MAP(obj));
 
+        case OBJ_BUILDER:
+            return copyString("<builder>", 9);
+
+        case OBJ_SHAPE:{
+            char buffer[32];
+            int length = snprintf(buffer, sizeof(buffer), "<shape %d>",
+                AS_SHAPE(obj)->fieldCount);
+            return copyString(buffer, length);
+        }
     }
 
     return copyString("null", 4);
 }
 
 ObjByte* newBytes(int length){
+    // Allocate the buffer first, a collection can't see the new object yet
+    ByteArray array;
+    initByteArray(&array, length);
+
     ObjByte* bytes = ALLOCATE_OBJ(ObjByte, OBJ_BYTE);
-    initByteArray(&bytes->bytes, length);
+    bytes->bytes = array;
     return bytes;
 }
 
@@ -3,10 +3,12 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
+#include "text.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -22,9 +24,11 @@
 #define IS_MAP(value) isObjType(value, OBJ_MAP)
 #define IS_FILE(value) isObjType(value, OBJ_FILE)
 #define IS_BYTE(value) isObjType(value, OBJ_BYTE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+#define IS_BUILDER(value) isObjType(value, OBJ_BUILDER)
 
 #define AS_STRING(value) (((ObjString*)AS_OBJ(value)))
-#define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_CSTRING(value) stringChars((ObjString*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
@@ -36,12 +40,15 @@
 #define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
 #define AS_FILE(value) ((ObjFile*)AS_OBJ(value))
 #define AS_BYTE(value) ((ObjByte*)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
+#define AS_BUILDER(value) ((ObjBuilder*)AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_CLOSURE,
+    OBJ_UPVALUE,
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
@@ -49,21 +56,55 @@ typedef enum {
     OBJ_MAP,
     OBJ_FILE,
     OBJ_BYTE,
+    OBJ_SHAPE,
+    OBJ_BUILDER,
 } ObjType;
 
 struct Obj {
     ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    bool isOld;         // survived a collection
+    bool isRemembered;  // old object in the remembered set
+    bool isFree;        // unused slab slot
 }; 
 
+// Strings up to this long are interned by default, longer ones are only
+// hashed if used as a key
+#define STRING_INTERN_MAX 64
+
+// Concatenations at least this long, and too long to be interned, only
+// build a rope
+#define ROPE_MIN_LENGTH 128
+
+// Strings up to this long keep their characters in the object itself, so
+// they take a single allocation. Longer ones point to a buffer of their own.
+#define STRING_INLINE_MAX 64
+
+// A rope holds the characters of left followed by those of right, copied
+// into a buffer of its own the first time they are needed, so building a
+// long string piece by piece doesn't copy it over and over
 struct ObjString{
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash;
+    uint32_t hash;  // 0 until needed if the string isn't interned
+    union {
+        char* chars;
+        struct ObjString* left;  // while a rope
+    };
+    struct ObjString* right;     // NULL unless a rope
+    bool interned;
+    bool inRope;                 // a rope may point to it, see unshareRopeHalf
+    char inlined[];              // chars points here if short enough
 };
 
+#define IS_ROPE(string) ((string)->right != NULL)
+#define IS_INLINE(string) ((string)->chars == (string)->inlined)
+
+// Bytes taken by the string object, its inline characters included
+static inline size_t stringSize(ObjString* string){
+    if(!IS_INLINE(string)) return sizeof(ObjString);
+    return offsetof(ObjString, inlined) + string->length + 1;
+}
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -74,6 +115,7 @@ typedef struct ObjUpvalue {
 typedef struct {
     Obj obj;
     int arity;
+    int maxStack; // max stack slots used by a frame, computed by compiler
     Chunk chunk;
     ObjString* name;
     int upvalueCount;
@@ -86,16 +128,31 @@ typedef struct{
     int upvalueCount;
 } ObjClosure;
 
+// Layout of an instance's fields. Shapes form a transition tree rooted at
+// the class: adding a field moves an instance to the child shape for that
+// name, so instances that get the same fields in the same order share it.
+struct ObjShape{
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* key;     // field added on top of parent, NULL for the root
+    int fieldCount;     // key is stored at index fieldCount - 1
+    Table transitions;  // field name -> child shape
+};
+
 typedef struct{
     Obj obj;
     ObjString* name;
     Table methods;
+    ObjShape* rootShape; // shape of new instances, without fields
 } ObjClass;
 
 typedef struct{
     Obj obj;
     ObjClass* kclass;
-    Table fields;
+    ObjShape* shape;    // NULL once the instance is in dictionary mode
+    Value* fields;      // field values, in the order of shape
+    int fieldCapacity;
+    Table dictionary;   // fields of an instance in dictionary mode
 } ObjInstance;
 
 typedef struct {
@@ -107,7 +164,6 @@ typedef struct {
 typedef struct{
     Obj obj;
     ValueArray array;
-    Table nativeMethods;
 } ObjList;
 
 typedef struct{
@@ -133,9 +189,16 @@ typedef struct {
     FILE *file;
     ObjString* mode;
     ObjString* path;
-    Table nativeMethods;
 } ObjFile;
 
+// Text appended to in place, copied into a string by build()
+struct ObjBuilder{
+    Obj obj;
+    int length;
+    int capacity;
+    char* chars;    // not NUL-terminated
+};
+
 typedef bool (*NativeFn)(int argCount, Value* args);
 typedef bool (*NativeObjFn)(int argCount, Value obj, Value* args);
 
@@ -154,11 +217,37 @@ typedef struct{
     } function;
 } ObjNative;
 
+void flattenString(ObjString* rope);
+
+static inline char* stringChars(ObjString* string){
+    if(IS_ROPE(string)) flattenString(string);
+    return string->chars;
+}
+
+static inline uint32_t stringHash(ObjString* string){
+    if(string->hash == 0 && !string->interned){
+        string->hash = hashString(stringChars(string), string->length);
+    }
+    return string->hash;
+}
+
+// Interned strings are equal only to themselves, the others are compared
+// by contents
+static inline bool stringsEqual(ObjString* a, ObjString* b){
+    if(a == b) return true;
+    if(a->interned && b->interned) return false;
+    return a->length == b->length &&
+        memcmp(stringChars(a), stringChars(b), a->length) == 0;
+}
+
 ObjString* copyString(const char* chars, int length);
 void printObject(Value value);
 bool isObjType(Value value, ObjType type);
 ObjString* takeString(char* chars, int length);
 ObjString* allocateString(char* chars, int length, uint32_t hash);
+ObjString* findInterned(const char* chars, int length, uint32_t* hash);
+ObjString* newRope(ObjString* left, ObjString* right);
+void unshareRopeHalf(ObjString* half);
 
 ObjFunction* newFunction();
 ObjClosure* newClosure(ObjFunction* function);
@@ -167,6 +256,7 @@ ObjNative* newObjNative(NativeObjFn function);
 
 ObjUpvalue* newObjUpvalue(Value* slot);
 
+ObjShape* newShape(ObjShape* parent, ObjString* key);
 ObjClass* newClass(ObjString* name);
 ObjInstance* newInstance(ObjClass* klass);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
@@ -174,6 +264,7 @@ ObjList* newList();
 ObjMap* newMap();
 
 ObjFile* newFile(ObjString* path, ObjString* mode);
+ObjBuilder* newBuilder();
 
 ObjByte* newBytes(int length);
 ObjByte* takeBytes(unsigned char* buffer, int length);
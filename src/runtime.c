@@ -3,22 +3,32 @@
 
 ObjNative* addNativeMethod(Table* method, const char* name, NativeFn func){
     ObjString* mname = copyString(name, strlen(name));
+    push(OBJ_VAL(mname));
     ObjNative* natFn = newNative(func);
+    push(OBJ_VAL(natFn));
     tableSet(method, mname, OBJ_VAL(natFn));
+    pop();
+    pop();
     return natFn;
 }
 
 ObjNative* addNativeObjMethod(Table* method, const char* name, NativeObjFn func){
     ObjString* mname = copyString(name, strlen(name));
+    push(OBJ_VAL(mname));
     ObjNative* natFn = newObjNative(func);
+    push(OBJ_VAL(natFn));
     tableSet(method, mname, OBJ_VAL(natFn));
+    pop();
+    pop();
     return natFn;
 }
 
 bool IsNativeMethodSupported(Value obj){
     if(
         IS_LIST(obj) ||
-        IS_FILE(obj)
+        IS_FILE(obj) ||
+        IS_BUILDER(obj) ||
+        IS_STRING(obj)
     ){
         return true;
     }
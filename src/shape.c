@@ -0,0 +1,98 @@
+#include "memory.h"
+#include "shape.h"
+#include "table.h"
+#include "vm.h"
+
+// Index of field `name` in instances of this shape, -1 if it has none.
+// Walks towards the root, each shape adds exactly one field.
+int shapeFieldIndex(ObjShape* shape, ObjString* name){
+    for(; shape->key != NULL; shape = shape->parent){
+        if(stringsEqual(shape->key, name)) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+// Shape reached from `shape` by adding field `name`, created on first use
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name){
+    Value child;
+    if(tableGet(&shape->transitions, name, &child)){
+        return AS_SHAPE(child);
+    }
+
+    ObjShape* next = newShape(shape, name);
+    push(OBJ_VAL(next));
+    tableSet(&shape->transitions, name, OBJ_VAL(next));
+    WRITE_BARRIER(shape);
+    pop();
+    return next;
+}
+
+void growInstanceFields(ObjInstance* instance){
+    int oldCapacity = instance->fieldCapacity;
+    instance->fieldCapacity = GROW_CAPACITY(oldCapacity);
+    instance->fields = GROW_ARRAY(
+        Value, instance->fields, oldCapacity, instance->fieldCapacity
+    );
+}
+
+// Moves the fields into a private hash table. Used once an instance has too
+// many fields to be worth sharing a layout.
+void instanceToDictionary(ObjInstance* instance){
+    ObjShape* shape = instance->shape;
+    if(shape == NULL) return;
+
+    // Keep the field values reachable through the shape until they are
+    // all in the table, growing it can trigger a collection
+    for(ObjShape* field = shape; field->key != NULL; field = field->parent){
+        tableSet(&instance->dictionary, field->key, instance->fields[field->fieldCount - 1]);
+        WRITE_BARRIER(instance);
+    }
+
+    instance->shape = NULL;
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value){
+    if(instance->shape == NULL){
+        return tableGet(&instance->dictionary, name, value);
+    }
+
+    int index = shapeFieldIndex(instance->shape, name);
+    if(index == -1) return false;
+    *value = instance->fields[index];
+    return true;
+}
+
+// Returns true if the field is new. The value must be reachable by the GC.
+bool instanceSetField(ObjInstance* instance, ObjString* name, Value value){
+    if(instance->shape != NULL){
+        int index = shapeFieldIndex(instance->shape, name);
+        if(index != -1){
+            instance->fields[index] = value;
+            WRITE_BARRIER(instance);
+            return false;
+        }
+
+        if(instance->shape->fieldCount < SHAPE_MAX_FIELDS){
+            index = instance->shape->fieldCount;
+            if(index == instance->fieldCapacity){
+                growInstanceFields(instance);
+            }
+            // Switch shapes only once the value is written, so the GC never
+            // marks the uninitialized slot
+            ObjShape* next = shapeTransition(instance->shape, name);
+            instance->fields[index] = value;
+            instance->shape = next;
+            WRITE_BARRIER(instance);
+            return true;
+        }
+
+        instanceToDictionary(instance);
+    }
+
+    bool isNewKey = tableSet(&instance->dictionary, name, value);
+    WRITE_BARRIER(instance);
+    return isNewKey;
+}
@@ -0,0 +1,19 @@
+#ifndef viper_shape_h
+#define viper_shape_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Instances that grow past this many fields fall back to dictionary mode
+#define SHAPE_MAX_FIELDS 32
+
+int shapeFieldIndex(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+
+void growInstanceFields(ObjInstance* instance);
+void instanceToDictionary(ObjInstance* instance);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+bool instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "slab.h"
+#include "vm.h"
+
+/*
+Every object lives in a slot of a slab page. Free slots are chained on one
+free list per size class, and are flagged so a walk over the pages can
+skip them. Their mark bits are always clear. Pages a collection hasn't
+swept yet are swept once their size class runs out of free slots.
+
+Compacting a size class moves the objects off its emptiest pages into the
+free slots of the others, so those pages can go back to the system.
+*/
+
+static FreeSlot* newPage(int sizeClass){
+    SlabPage* page = (SlabPage*)aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    // Unable to allocate a new page of objects
+    if(page == NULL) exit(1);
+
+    memset(page->marks, 0, sizeof(page->marks));
+    page->slotSize = (sizeClass + 1) * SLAB_GRANULE;
+    page->slotCount = (SLAB_PAGE_SIZE - sizeof(SlabPage)) / page->slotSize;
+    page->usedSlots = 0;
+    page->swept = true;
+    page->evacuated = false;
+    page->next = vm.pages[sizeClass];
+    vm.pages[sizeClass] = page;
+
+    // Hand slots out in address order
+    FreeSlot* free = NULL;
+    for(int i = page->slotCount - 1; i >= 0; i--){
+        FreeSlot* slot = (FreeSlot*)SLAB_SLOT(page, i);
+        slot->obj.isFree = true;
+        slot->next = free;
+        free = slot;
+    }
+    return free;
+}
+
+Obj* slabAllocate(size_t size){
+    int sizeClass = SLAB_CLASS(size);
+    if(sizeClass >= SLAB_CLASS_COUNT){
+        fprintf(stderr, "Object of %zu bytes is too large for a slab.\n", size);
+        exit(1);
+    }
+
+    FreeSlot* slot = vm.freeSlots[sizeClass];
+    while(slot == NULL && vm.sweepPages[sizeClass] != NULL){
+        sweepPage(sizeClass);
+        slot = vm.freeSlots[sizeClass];
+    }
+    if(slot == NULL) slot = newPage(sizeClass);
+
+    vm.freeSlots[sizeClass] = slot->next;
+    slot->obj.isFree = false;
+    SLAB_PAGE(slot)->usedSlots++;
+    return (Obj*)slot;
+}
+
+void slabFree(Obj* object, size_t size){
+    FreeSlot* slot = (FreeSlot*)object;
+    int sizeClass = SLAB_CLASS(size);
+    slot->obj.isFree = true;
+    slot->next = vm.freeSlots[sizeClass];
+    vm.freeSlots[sizeClass] = slot;
+    SLAB_PAGE(slot)->usedSlots--;
+}
+
+static int compareUsedSlots(const void* a, const void* b){
+    return (*(SlabPage**)a)->usedSlots - (*(SlabPage**)b)->usedSlots;
+}
+
+// Flags the emptiest pages of a size class whose objects fit in the free
+// slots of the others, and leaves only those slots on the free list.
+// Returns how many pages were flagged.
+int slabEvacuate(int sizeClass){
+    int pageCount = 0;
+    int freeCount = 0;
+    for(SlabPage* page = vm.pages[sizeClass]; page != NULL; page = page->next){
+        pageCount++;
+        freeCount += page->slotCount - page->usedSlots;
+    }
+    if(pageCount < 2) return 0;
+
+    SlabPage** pages = (SlabPage**)malloc(sizeof(SlabPage*) * pageCount);
+    // Unable to allocate memory to compact the heap
+    if(pages == NULL) exit(1);
+
+    int i = 0;
+    for(SlabPage* page = vm.pages[sizeClass]; page != NULL; page = page->next){
+        pages[i++] = page;
+    }
+    qsort(pages, pageCount, sizeof(SlabPage*), compareUsedSlots);
+
+    int evacuated = 0;
+    int moving = 0;
+    for(; evacuated < pageCount - 1; evacuated++){
+        SlabPage* page = pages[evacuated];
+        int slotsLeft = freeCount - (page->slotCount - page->usedSlots);
+        if(moving + page->usedSlots > slotsLeft) break;
+
+        page->evacuated = true;
+        moving += page->usedSlots;
+        freeCount = slotsLeft;
+    }
+    free(pages);
+    if(evacuated == 0) return 0;
+
+    // Objects are moved to the free slots of the pages that stay
+    FreeSlot* free = NULL;
+    for(SlabPage* page = vm.pages[sizeClass]; page != NULL; page = page->next){
+        if(page->evacuated) continue;
+        for(int j = page->slotCount - 1; j >= 0; j--){
+            FreeSlot* slot = (FreeSlot*)SLAB_SLOT(page, j);
+            if(!slot->obj.isFree) continue;
+            slot->next = free;
+            free = slot;
+        }
+    }
+    vm.freeSlots[sizeClass] = free;
+    return evacuated;
+}
+
+// Gives the evacuated pages of a size class back to the system
+void slabRelease(int sizeClass){
+    SlabPage** link = &vm.pages[sizeClass];
+    while(*link != NULL){
+        SlabPage* page = *link;
+        if(page->evacuated){
+            *link = page->next;
+            free(page);
+        } else {
+            link = &page->next;
+        }
+    }
+}
+
+void freeSlabs(){
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        SlabPage* page = vm.pages[i];
+        while(page != NULL){
+            SlabPage* next = page->next;
+            free(page);
+            page = next;
+        }
+        vm.pages[i] = NULL;
+        vm.freeSlots[i] = NULL;
+        vm.sweepPages[i] = NULL;
+    }
+}
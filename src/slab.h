@@ -0,0 +1,62 @@
+#ifndef viper_slab_h
+#define viper_slab_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+
+// Objects are carved out of pages of this many bytes, each page holding
+// slots of a single size class. Pages are aligned to their size so the
+// page of an object is found from its address.
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+// Size classes are multiples of this many bytes, up to the largest object
+#define SLAB_GRANULE 8
+#define SLAB_CLASS_COUNT 16
+
+#define SLAB_CLASS(size) (((size) - 1) / SLAB_GRANULE)
+
+#define SLAB_SLOT(page, index) \
+    ((Obj*)((char*)(page) + sizeof(SlabPage) + \
+        (size_t)(index) * (page)->slotSize))
+
+#define SLAB_PAGE(object) \
+    ((SlabPage*)((uintptr_t)(object) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+// Mark bits live in the page instead of the objects, one per granule
+#define SLAB_MARK_BIT(object) \
+    (((uintptr_t)(object) & (SLAB_PAGE_SIZE - 1)) / SLAB_GRANULE)
+#define SLAB_MARK_WORD(object) \
+    (SLAB_PAGE(object)->marks[SLAB_MARK_BIT(object) / 64])
+#define SLAB_MARK_MASK(object) \
+    ((uint64_t)1 << (SLAB_MARK_BIT(object) % 64))
+
+#define IS_MARKED(object) \
+    ((SLAB_MARK_WORD(object) & SLAB_MARK_MASK(object)) != 0)
+#define SET_MARKED(object)      (SLAB_MARK_WORD(object) |= SLAB_MARK_MASK(object))
+#define CLEAR_MARKED(object)    (SLAB_MARK_WORD(object) &= ~SLAB_MARK_MASK(object))
+
+typedef struct SlabPage {
+    struct SlabPage* next;
+    int slotSize;
+    int slotCount;
+    int usedSlots;
+    bool swept;     // by the running collection, if any
+    bool evacuated; // by the running compaction
+    uint64_t marks[SLAB_PAGE_SIZE / SLAB_GRANULE / 64];
+} SlabPage;
+
+// A free slot links to the next one of its size class
+typedef struct FreeSlot {
+    Obj obj;
+    struct FreeSlot* next;
+} FreeSlot;
+
+Obj* slabAllocate(size_t size);
+void slabFree(Obj* object, size_t size);
+int slabEvacuate(int sizeClass);
+void slabRelease(int sizeClass);
+void freeSlabs();
+
+#endif
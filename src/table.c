@@ -24,7 +24,7 @@ Entry* findEntry(Entry* entires, int capacity, ObjString* key){
     // uint32_t index = key->hash % capacity;
     // Faster modulo calculation
     // A Mod B = A & (B-1), when B is power of 2  
-    uint32_t index = key->hash & (capacity - 1);
+    uint32_t index = stringHash(key) & (capacity - 1);
 
     Entry* tombstone = NULL;
 
@@ -39,7 +39,7 @@ Entry* findEntry(Entry* entires, int capacity, ObjString* key){
                 // found tombstone
                 if (tombstone == NULL) tombstone = entry;
             }
-        } else if (entry->key == key){
+        } else if (stringsEqual(entry->key, key)){
             // found key
             return entry;
         }
@@ -121,32 +121,3 @@ bool tableDelete(Table* table, ObjString* key){
     entry->value = BOOL_VAL(true);
     return true;
 }
-
-// String interning
-ObjString* tableFindString(
-    Table* table, 
-    const char* chars,
-    int length, 
-    uint32_t hash
-){
-    if(table->count == 0) return NULL;
-
-    // uint32_t index = hash % table->capacity;
-    uint32_t index = hash & (table->capacity - 1);
-
-    for(;;){
-        Entry* entry = &table->entires[index];
-
-        if(entry->key == NULL){
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NULL(entry->value)) return NULL;
-        } else if(entry->key->length == length &&
-            entry->key->hash == hash &&
-            memcmp(entry->key->chars, chars, length) == 0){
-            // We found it.
-            return entry->key;
-        }
-        // index = (index+1) % table -> capacity;
-        index = (index+1) & (table -> capacity - 1);
-    }
-}
\ No newline at end of file
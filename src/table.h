@@ -22,7 +22,4 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 
-ObjString* tableFindString(Table* table, const char* chars,
-                           int length, uint32_t hash);
-
 #endif
\ No newline at end of file
@@ -0,0 +1,523 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "text.h"
+
+#include "builtin.h"
+#include "memory.h"
+#include "object.h"
+#include "runtime.h"
+#include "vm.h"
+
+// Hashing
+//
+// Strings up to 16 bytes, nearly all identifiers and keys, are read as two
+// possibly overlapping words and mixed once. Longer ones are hashed 16
+// bytes per step, and those of at least HASH_LONG bytes as stripes of 32
+// bytes summed into four lanes, vectorized with AVX2 or SSE2 when the
+// build has it. Every path gives the same hash.
+
+#define HASH_LONG 128
+#define HASH_LANES 4
+#define HASH_STRIPE (HASH_LANES * 8)
+// The lanes are scrambled after every block of this many stripes, each
+// stripe of a block is keyed by its own window of hashSecret
+#define HASH_BLOCK_STRIPES 16
+
+static const uint64_t hashSecret[HASH_LANES + HASH_BLOCK_STRIPES] = {
+    0xba8894fa3be59747, 0x069945dea82460db, 0xf2b5717db02809eb,
+    0x4604208f575a097b, 0x9b2af0a33458f9d3, 0x0036c74e48fed613,
+    0x250924992b7b8fb9, 0x11c2dd5402147e8b, 0xa150217aa00ce50f,
+    0x1b08078cdca13467, 0x0ba8d4827c1ac113, 0x10f3ff5b71bb3209,
+    0x378ae3c511f071f3, 0x2edc5bbc191f9c17, 0x8f4870d0d2ffeacb,
+    0x0bdfe62b0dad52f7, 0x81b330eb8eb7f693, 0xde7c4e8eb1d4ec37,
+    0x5a3a88dd3d4ce485, 0xac4ee57bbf8f82b3,
+};
+
+static inline uint64_t read64(const char* bytes){
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint64_t read32(const char* bytes){
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Both halves of the 128 bit product, folded
+static inline uint64_t mix(uint64_t a, uint64_t b){
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// Adds stripes to the lanes of acc. Each 64 bit lane gets the product of
+// the low and high halves of its keyed input, plus the input of its
+// neighbour, so no input bits are lost to a zero product.
+static void accumulate(uint64_t* acc, const char* bytes, int stripes){
+#if defined(__AVX2__)
+    __m256i sum = _mm256_loadu_si256((const __m256i*) acc);
+    for(int i = 0; i < stripes; i++){
+        __m256i input = _mm256_loadu_si256((const __m256i*)(bytes + i * HASH_STRIPE));
+        __m256i keyed = _mm256_xor_si256(input,
+            _mm256_loadu_si256((const __m256i*)(hashSecret + i)));
+        __m256i high = _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1));
+        __m256i neighbour = _mm256_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2));
+        sum = _mm256_add_epi64(sum,
+            _mm256_add_epi64(_mm256_mul_epu32(keyed, high), neighbour));
+    }
+    _mm256_storeu_si256((__m256i*) acc, sum);
+#elif defined(__SSE2__)
+    __m128i sum[2];
+    for(int lane = 0; lane < 2; lane++){
+        sum[lane] = _mm_loadu_si128((const __m128i*)(acc + 2 * lane));
+    }
+    for(int i = 0; i < stripes; i++){
+        for(int lane = 0; lane < 2; lane++){
+            __m128i input = _mm_loadu_si128(
+                (const __m128i*)(bytes + i * HASH_STRIPE + 16 * lane));
+            __m128i keyed = _mm_xor_si128(input,
+                _mm_loadu_si128((const __m128i*)(hashSecret + i + 2 * lane)));
+            __m128i high = _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1));
+            __m128i neighbour = _mm_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2));
+            sum[lane] = _mm_add_epi64(sum[lane],
+                _mm_add_epi64(_mm_mul_epu32(keyed, high), neighbour));
+        }
+    }
+    for(int lane = 0; lane < 2; lane++){
+        _mm_storeu_si128((__m128i*)(acc + 2 * lane), sum[lane]);
+    }
+#else
+    for(int i = 0; i < stripes; i++){
+        for(int lane = 0; lane < HASH_LANES; lane++){
+            uint64_t input = read64(bytes + i * HASH_STRIPE + 8 * lane);
+            uint64_t keyed = input ^ hashSecret[i + lane];
+            acc[lane ^ 1] += input;
+            acc[lane] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+    }
+#endif
+}
+
+// Spreads the high bits of each lane over the low ones, so summing the
+// next block doesn't commute with this one
+static void scramble(uint64_t* acc){
+    for(int lane = 0; lane < HASH_LANES; lane++){
+        uint64_t value = acc[lane] ^ (acc[lane] >> 47) ^ hashSecret[lane];
+        acc[lane] = value * 0x9e3779b1u;
+    }
+}
+
+static uint64_t hashLong(const char* key, int length){
+    uint64_t acc[HASH_LANES];
+    memcpy(acc, hashSecret, sizeof(acc));
+
+    // The last stripe, whole or not, is hashed from the end of the string
+    int stripes = (length - 1) / HASH_STRIPE;
+    for(int i = 0; i < stripes; i += HASH_BLOCK_STRIPES){
+        int count = stripes - i < HASH_BLOCK_STRIPES ? stripes - i : HASH_BLOCK_STRIPES;
+        accumulate(acc, key + i * HASH_STRIPE, count);
+        scramble(acc);
+    }
+    accumulate(acc, key + length - HASH_STRIPE, 1);
+
+    return mix(mix(acc[0] ^ hashSecret[4], acc[1] ^ hashSecret[5]) ^ length,
+        mix(acc[2] ^ hashSecret[6], acc[3] ^ hashSecret[7]));
+}
+
+uint32_t hashString(const char* key, int length){
+    uint64_t hash;
+    if(length <= 16){
+        uint64_t a = 0;
+        uint64_t b = 0;
+        if(length >= 8){
+            a = read64(key);
+            b = read64(key + length - 8);
+        } else if(length >= 4){
+            a = read32(key);
+            b = read32(key + length - 4);
+        } else if(length > 0){
+            a = (uint64_t)(uint8_t)key[0] << 16 |
+                (uint64_t)(uint8_t)key[length >> 1] << 8 |
+                (uint8_t)key[length - 1];
+        }
+        hash = mix(a ^ hashSecret[0], b ^ hashSecret[1] ^ (uint64_t)length);
+    } else if(length < HASH_LONG){
+        hash = hashSecret[HASH_LANES + HASH_BLOCK_STRIPES - 1] ^ (uint64_t)length;
+        for(int i = 0; i + 16 < length; i += 16){
+            hash = mix(read64(key + i) ^ hashSecret[0] ^ hash,
+                read64(key + i + 8) ^ hashSecret[1]);
+        }
+        hash = mix(read64(key + length - 16) ^ hashSecret[2] ^ hash,
+            read64(key + length - 8) ^ hashSecret[3]);
+    } else {
+        hash = hashLong(key, length);
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Searching
+//
+// A position can only start a match if it holds the first and the last
+// char of the pattern, which is checked for 16 positions at a time before
+// comparing the rest.
+
+// Index of the first occurrence of pattern in text, or -1
+int findText(const char* text, int length, const char* pattern, int patternLength){
+    if(patternLength == 0) return 0;
+    if(patternLength > length) return -1;
+
+    int last = length - patternLength; // last position a match can start
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(pattern[0]);
+    __m128i final = _mm_set1_epi8(pattern[patternLength - 1]);
+    for(; i + 15 <= last; i += 16){
+        __m128i starts = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i ends = _mm_loadu_si128(
+            (const __m128i*)(text + i + patternLength - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, final)));
+
+        while(mask != 0){
+            int start = i + __builtin_ctz(mask);
+            if(patternLength <= 2 ||
+                    memcmp(text + start + 1, pattern + 1, patternLength - 2) == 0){
+                return start;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while(i <= last){
+        const char* found = memchr(text + i, pattern[0], last - i + 1);
+        if(found == NULL) return -1;
+
+        i = (int)(found - text);
+        if(memcmp(text + i + 1, pattern + 1, patternLength - 1) == 0) return i;
+        i++;
+    }
+    return -1;
+}
+
+// Numbers
+//
+// Numbers print as printf's "%g" would: six significant digits, in fixed
+// notation unless the exponent is below -4 or above 5. Integers that short
+// are written directly. Any other number is scaled by a power of ten to six
+// integer digits, rounded and laid out, which takes a single rounding
+// error. The few numbers so close to halfway between two results that the
+// error could matter are left to snprintf, as are infinities and NaN.
+
+#define FORMAT_DIGITS 6
+#define POW10_MIN -17
+#define POW10_MAX 27
+// Exact powers of ten stop at 1e22
+#define POW10_EXACT 22
+
+static const double pow10Table[POW10_MAX - POW10_MIN + 1] = {
+    1e-17, 1e-16, 1e-15, 1e-14, 1e-13, 1e-12, 1e-11, 1e-10, 1e-9, 1e-8,
+    1e-7, 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5,
+    1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+    1e18, 1e19, 1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26, 1e27,
+};
+
+#define POW10(exponent) (pow10Table[(exponent) - POW10_MIN])
+
+// Writes the decimal digits of value, returns how many
+static int writeDigits(uint64_t value, char* buffer){
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while(value != 0);
+
+    for(int i = 0; i < count; i++){
+        buffer[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+// Writes the FORMAT_DIGITS digits of a number whose leading digit has the
+// given exponent, as "%g" lays them out
+static int layoutNumber(char* buffer, bool negative, char* digits, int exponent){
+    char* end = buffer;
+    if(negative) *end++ = '-';
+
+    int count = FORMAT_DIGITS;
+    while(count > 1 && digits[count - 1] == '0') count--;
+
+    if(exponent < -4 || exponent >= FORMAT_DIGITS){
+        *end++ = digits[0];
+        if(count > 1){
+            *end++ = '.';
+            memcpy(end, digits + 1, count - 1);
+            end += count - 1;
+        }
+        *end++ = 'e';
+        *end++ = exponent < 0 ? '-' : '+';
+        int magnitude = exponent < 0 ? -exponent : exponent;
+        if(magnitude < 10) *end++ = '0';
+        end += writeDigits((uint64_t)magnitude, end);
+    } else if(exponent < 0){
+        *end++ = '0';
+        *end++ = '.';
+        memset(end, '0', -exponent - 1);
+        end += -exponent - 1;
+        memcpy(end, digits, count);
+        end += count;
+    } else {
+        int whole = exponent + 1;
+        memcpy(end, digits, whole);
+        end += whole;
+        if(count > whole){
+            *end++ = '.';
+            memcpy(end, digits + whole, count - whole);
+            end += count - whole;
+        }
+    }
+
+    *end = '\0';
+    return (int)(end - buffer);
+}
+
+// Writes the text of a number into buffer, which holds NUMBER_FORMAT_MAX
+// chars, and returns its length
+int formatNumber(double number, char* buffer){
+    bool negative = signbit(number);
+    double magnitude = fabs(number);
+
+    if(magnitude < 1e6 && magnitude == (double)(int)magnitude){
+        char* end = buffer;
+        if(negative) *end++ = '-';
+        end += writeDigits((uint64_t)magnitude, end);
+        *end = '\0';
+        return (int)(end - buffer);
+    }
+
+    if(magnitude >= POW10(POW10_MIN) && magnitude < POW10(POW10_MAX)){
+        int exponent = POW10_MIN;
+        while(exponent < POW10_MAX && magnitude >= POW10(exponent + 1)){
+            exponent++;
+        }
+
+        // Multiplying or dividing by an exact power of ten rounds once
+        int shift = FORMAT_DIGITS - 1 - exponent;
+        if(shift >= -POW10_EXACT && shift <= POW10_EXACT){
+            double scaled = shift >= 0 ? magnitude * POW10(shift)
+                                       : magnitude / POW10(-shift);
+            double whole = floor(scaled);
+            double fraction = scaled - whole;
+            uint64_t value = (uint64_t)whole + (fraction > 0.5);
+
+            if(value == 1000000){
+                value = 100000;
+                exponent++;
+            }
+            if(fabs(fraction - 0.5) > 1e-6 && value >= 100000 && value < 1000000){
+                char digits[FORMAT_DIGITS];
+                writeDigits(value, digits);
+                return layoutNumber(buffer, negative, digits, exponent);
+            }
+        }
+    }
+
+    return snprintf(buffer, NUMBER_FORMAT_MAX, "%g", number);
+}
+
+// Reads a decimal number, an optional sign, digits with an optional
+// fraction, then an optional exponent, from the start of text. Returns the
+// chars read, 0 if there is no number. Up to 19 significant digits are
+// gathered into an integer, and one that is exact as a double times an
+// exact power of ten gives the right result in a single operation. Other
+// numbers go to strtod.
+int parseNumber(const char* text, int length, double* number){
+    int i = 0;
+    bool negative = false;
+    if(i < length && (text[i] == '-' || text[i] == '+')){
+        negative = text[i] == '-';
+        i++;
+    }
+
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    int digits = 0;
+    bool exact = true;
+
+    for(; i < length && text[i] >= '0' && text[i] <= '9'; i++, digits++){
+        if(significant < 19){
+            mantissa = mantissa * 10 + (uint64_t)(text[i] - '0');
+            if(mantissa != 0) significant++;
+        } else {
+            exponent++;
+            if(text[i] != '0') exact = false;
+        }
+    }
+    if(i < length && text[i] == '.' && i + 1 < length &&
+            text[i + 1] >= '0' && text[i + 1] <= '9'){
+        for(i++; i < length && text[i] >= '0' && text[i] <= '9'; i++, digits++){
+            if(significant < 19){
+                mantissa = mantissa * 10 + (uint64_t)(text[i] - '0');
+                if(mantissa != 0) significant++;
+                exponent--;
+            } else if(text[i] != '0'){
+                exact = false;
+            }
+        }
+    }
+    if(digits == 0) return 0;
+
+    if(i < length && (text[i] == 'e' || text[i] == 'E')){
+        int j = i + 1;
+        bool negativeExponent = false;
+        if(j < length && (text[j] == '-' || text[j] == '+')){
+            negativeExponent = text[j] == '-';
+            j++;
+        }
+        if(j < length && text[j] >= '0' && text[j] <= '9'){
+            int power = 0;
+            for(; j < length && text[j] >= '0' && text[j] <= '9'; j++){
+                if(power < 100000) power = power * 10 + (text[j] - '0');
+            }
+            exponent += negativeExponent ? -power : power;
+            i = j;
+        }
+    }
+
+    if(exact && mantissa <= (1ULL << 53) &&
+            exponent >= -POW10_EXACT && exponent <= POW10_EXACT){
+        double value = (double)mantissa;
+        value = exponent >= 0 ? value * POW10(exponent) : value / POW10(-exponent);
+        *number = negative ? -value : value;
+        return i;
+    }
+
+    // strtod needs the text terminated
+    char small[64];
+    char* copy = i < (int)sizeof(small) ? small : malloc(i + 1);
+    if(copy == NULL) exit(1);
+    memcpy(copy, text, i);
+    copy[i] = '\0';
+    *number = strtod(copy, NULL);
+    if(copy != small) free(copy);
+    return i;
+}
+
+// String methods
+
+static bool stringArgument(int argCount, Value* args, const char* method){
+    char message[64];
+    if(argCount < 1 || !IS_STRING(args[0])){
+        snprintf(message, sizeof(message), "Expected a string argument to %s method.", method);
+        args[-1] = errorOutput(message);
+        return false;
+    }
+    return true;
+}
+
+// find(pattern[, start]): index of the first occurrence at or after start,
+// or -1
+bool findString(int argCount, Value self, Value* args){
+    if(!stringArgument(argCount, args, "find")) return false;
+
+    ObjString* string = AS_STRING(self);
+    ObjString* pattern = AS_STRING(args[0]);
+    int start = 0;
+    if(argCount > 1){
+        if(!IS_NUMBER(args[1])){
+            args[-1] = errorOutput("Expected argument type Number for start of find method.");
+            return false;
+        }
+        start = (int)AS_NUMBER(args[1]);
+        if(start < 0) start = 0;
+    }
+
+    int index = -1;
+    if(start <= string->length){
+        index = findText(stringChars(string) + start, string->length - start,
+            stringChars(pattern), pattern->length);
+    }
+    args[-1] = NUMBER_VAL(index < 0 ? -1 : index + start);
+    return true;
+}
+
+// count(pattern): occurrences that don't overlap
+bool countString(int argCount, Value self, Value* args){
+    if(!stringArgument(argCount, args, "count")) return false;
+
+    ObjString* string = AS_STRING(self);
+    ObjString* pattern = AS_STRING(args[0]);
+    const char* chars = stringChars(string);
+    const char* patternChars = stringChars(pattern);
+
+    int count = 0;
+    if(pattern->length == 0){
+        count = string->length + 1;
+    } else {
+        int start = 0;
+        for(;;){
+            int index = findText(chars + start, string->length - start,
+                patternChars, pattern->length);
+            if(index < 0) break;
+            count++;
+            start += index + pattern->length;
+        }
+    }
+    args[-1] = NUMBER_VAL(count);
+    return true;
+}
+
+// split(separator): list of the parts between occurrences of separator
+bool splitString(int argCount, Value self, Value* args){
+    if(!stringArgument(argCount, args, "split")) return false;
+
+    ObjString* string = AS_STRING(self);
+    ObjString* separator = AS_STRING(args[0]);
+    if(separator->length == 0){
+        args[-1] = errorOutput("Empty separator for split method.");
+        return false;
+    }
+
+    // Neither buffer is freed or moved while the parts are allocated
+    const char* chars = stringChars(string);
+    const char* separatorChars = stringChars(separator);
+
+    ObjList* list = newList();
+    push(OBJ_VAL(list));
+    int start = 0;
+    for(;;){
+        int index = findText(chars + start, string->length - start,
+            separatorChars, separator->length);
+        int end = index < 0 ? string->length : start + index;
+
+        Value part = OBJ_VAL(copyString(chars + start, end - start));
+        push(part);
+        writeValueArray(&list->array, part);
+        WRITE_BARRIER(list);
+        pop();
+
+        if(index < 0) break;
+        start = end + separator->length;
+    }
+    pop();
+
+    args[-1] = OBJ_VAL(list);
+    return true;
+}
+
+void initStringNativeMethods(Table* methods){
+    addNativeObjMethod(methods, "find", findString);
+    addNativeObjMethod(methods, "count", countString);
+    addNativeObjMethod(methods, "split", splitString);
+}
@@ -0,0 +1,17 @@
+#ifndef viper_text_h
+#define viper_text_h
+
+#include <stdint.h>
+
+#include "table.h"
+
+// Longest text formatNumber() writes, with the NUL
+#define NUMBER_FORMAT_MAX 32
+
+uint32_t hashString(const char* key, int length);
+int findText(const char* text, int length, const char* pattern, int patternLength);
+int formatNumber(double number, char* buffer);
+int parseNumber(const char* text, int length, double* number);
+void initStringNativeMethods(Table* methods);
+
+#endif
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void initValueArray(ValueArray* array){
     array->capacity = 0;
@@ -22,12 +24,36 @@ void writeValueArray(ValueArray* array, Value value){
     array->count++;
 }
 
+// Appends count values with at most one allocation. An empty array is
+// sized exactly, so list literals don't over-allocate.
+void appendValueArray(ValueArray* array, const Value* values, int count){
+    if(count == 0) return;
+
+    if(array->capacity < array->count + count){
+        int oldCapacity = array->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        if(oldCapacity == 0 || capacity < array->count + count){
+            capacity = array->count + count;
+        }
+        array->values = GROW_ARRAY(Value, array->values, oldCapacity, capacity);
+        array->capacity = capacity;
+    }
+    memcpy(array->values + array->count, values, sizeof(Value) * count);
+    array->count += count;
+}
+
 
 void freeValueArray(ValueArray* array){
     FREE_ARRAY(Value, array->values, array->capacity);
     initValueArray(array);
 }
 
+static void printNumber(double number){
+    char buffer[NUMBER_FORMAT_MAX];
+    formatNumber(number, buffer);
+    fputs(buffer, stdout);
+}
+
 void printValue(Value value){
 #ifdef NAN_BOXING
     if(IS_BOOL(value)){
@@ -35,7 +61,7 @@ void printValue(Value value){
     } else if(IS_NULL(value)){
         printf("null");
     } else if(IS_NUMBER(value)){
-        printf("%g", AS_NUMBER(value));
+        printNumber(AS_NUMBER(value));
     } else if(IS_OBJ(value)){
         printObject(value);
     }
@@ -46,8 +72,9 @@ void printValue(Value value){
             break;
 
         case VAL_NULL: printf("null"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER: printNumber(AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_EMPTY: break; // never reaches a script
     }
 #endif
 }
@@ -57,6 +84,9 @@ bool valuesEqual(Value a, Value b){
     if(IS_NUMBER(a) && IS_NUMBER(b)){
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
+    if(IS_STRING(a) && IS_STRING(b)){
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
+    }
     return a == b;
 #else
     if(a.type != b.type) return false;
@@ -64,7 +94,11 @@ bool valuesEqual(Value a, Value b){
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NULL: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if(IS_STRING(a) && IS_STRING(b)){
+                return stringsEqual(AS_STRING(a), AS_STRING(b));
+            }
+            return AS_OBJ(a) == AS_OBJ(b);
 
         default: return false;
     }
@@ -80,7 +114,7 @@ uint32_t hashBits(double hash)
 uint32_t hashObject(Obj* obj){
     switch(obj->type){
         case OBJ_STRING:
-            return ((ObjString*) obj)->hash;
+            return stringHash((ObjString*) obj);
 
         default:
             return 0;
@@ -108,6 +142,7 @@ uint32_t hashValue(Value value){
         case VAL_NULL:  return 2;
         case VAL_NUMBER:   return hashNumber(AS_NUMBER(value));
         case VAL_OBJ:   return hashObject(AS_OBJ(value));
+        case VAL_EMPTY: break; // never used as a key
     }
     
     return 0;
@@ -126,16 +161,16 @@ ObjString* strValue(Value obj){
     // Number
     } else if(IS_NUMBER(obj)){
         double number = AS_NUMBER(obj);
-        int len = snprintf(NULL, 0, "%g", number);
-        
-        char *output = ALLOCATE(char, len+1);
-        
-        snprintf(output, len + 1, "%g", number);
-        
-        ObjString* string = copyString(output, len);
-        
-        FREE(char, output);
-        
+        bool cached = number >= 0 && number < NUMBER_STRING_CACHE &&
+            number == (int)number && !signbit(number);
+        if(cached && vm.numberStrings[(int)number] != NULL){
+            return vm.numberStrings[(int)number];
+        }
+
+        char buffer[NUMBER_FORMAT_MAX];
+        int length = formatNumber(number, buffer);
+        ObjString* string = copyString(buffer, length);
+        if(cached) vm.numberStrings[(int)number] = string;
         return string;
     }
 
@@ -163,9 +198,94 @@ ObjString* strValue(Value obj){
     }
 }
 
+// Takes string out of the strings str() keeps for small integers, if it
+// is one of them
+void forgetNumberString(ObjString* string){
+    if(string->length == 0 || string->length > 4 || IS_ROPE(string)) return;
+
+    int number = 0;
+    for(int i = 0; i < string->length; i++){
+        char c = string->chars[i];
+        if(c < '0' || c > '9') return;
+        number = number * 10 + (c - '0');
+    }
+    if(number < NUMBER_STRING_CACHE && vm.numberStrings[number] == string){
+        vm.numberStrings[number] = NULL;
+    }
+}
+
+// Makes room for length more chars, the builder must be reachable
+static void reserveBuilder(ObjBuilder* builder, int length){
+    if(builder->length + length <= builder->capacity) return;
+
+    int capacity = GROW_CAPACITY(builder->capacity);
+    while(capacity < builder->length + length) capacity *= 2;
+    builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity, capacity);
+    builder->capacity = capacity;
+}
+
+// Appends the text str() gives the value. Strings and numbers are copied
+// straight into the builder, only other values are made into a string.
+void appendValue(ObjBuilder* builder, Value value){
+    if(IS_NUMBER(value)){
+        char buffer[NUMBER_FORMAT_MAX];
+        int length = formatNumber(AS_NUMBER(value), buffer);
+        reserveBuilder(builder, length);
+        memcpy(builder->chars + builder->length, buffer, length);
+        builder->length += length;
+        return;
+    }
+
+    ObjString* string = strValue(value);
+    push(OBJ_VAL(string));
+    reserveBuilder(builder, string->length);
+    memcpy(builder->chars + builder->length, stringChars(string), string->length);
+    builder->length += string->length;
+    pop();
+}
+
+// Joins strings and numbers with separator between them, sizing the result
+// before copying anything into it. Returns NULL if another value is found.
+ObjString* joinValues(Value* values, int count, ObjString* separator){
+    char buffer[NUMBER_FORMAT_MAX];
+    int length = count > 0 ? separator->length * (count - 1) : 0;
+    for(int i = 0; i < count; i++){
+        if(IS_STRING(values[i])){
+            length += AS_STRING(values[i])->length;
+        } else if(IS_NUMBER(values[i])){
+            length += formatNumber(AS_NUMBER(values[i]), buffer);
+        } else {
+            return NULL;
+        }
+    }
+
+    // A short result is joined on the stack and copied into its object
+    char inlineChars[STRING_INLINE_MAX + 1];
+    char* chars = length <= STRING_INLINE_MAX ? inlineChars : ALLOCATE(char, length + 1);
+    char* end = chars;
+    for(int i = 0; i < count; i++){
+        if(i > 0){
+            memcpy(end, stringChars(separator), separator->length);
+            end += separator->length;
+        }
+
+        if(IS_STRING(values[i])){
+            ObjString* string = AS_STRING(values[i]);
+            memcpy(end, stringChars(string), string->length);
+            end += string->length;
+        } else {
+            end += formatNumber(AS_NUMBER(values[i]), end);
+        }
+    }
+    if(chars == inlineChars) return copyString(chars, length);
+
+    *end = '\0';
+    return takeString(chars, length);
+}
+
 void initByteArray(ByteArray* bytes, int length){
     bytes->count = length;
-    bytes->byte = GROW_ARRAY(unsigned char, bytes->byte, 0, bytes->count);
+    bytes->byte = GROW_ARRAY(unsigned char, NULL, 0, bytes->count);
 }
 
 void freeByteArray(ByteArray* bytes){
@@ -7,6 +7,8 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjShape ObjShape;
+typedef struct ObjBuilder ObjBuilder;
 
 typedef enum {
     TYPE_FUNCTION, // Body of function
@@ -24,11 +26,13 @@ typedef enum {
 #define TAG_NULL 1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3 // 11
+#define TAG_EMPTY 0 // 00, never visible to scripts
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_NULL(value)   ((value) == NULL_VAL)
+#define IS_EMPTY(value)  ((value) == EMPTY_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)   \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -42,6 +46,7 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NULL_VAL        ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define EMPTY_VAL       ((Value)(uint64_t)(QNAN | TAG_EMPTY))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj)    \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -64,7 +69,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NULL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_EMPTY // never visible to scripts
 } ValueType;
 
 typedef struct{
@@ -80,6 +86,7 @@ typedef struct{
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_NULL(value) ((value).type == VAL_NULL)
+#define IS_EMPTY(value) ((value).type == VAL_EMPTY)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value) ((value).as.boolean)
@@ -88,6 +95,7 @@ typedef struct{
 
 #define BOOL_VAL(value) ((Value){ VAL_BOOL, { .boolean = value} })
 #define NULL_VAL ((Value){ VAL_NULL, { .number = 0} })
+#define EMPTY_VAL ((Value){ VAL_EMPTY, { .number = 0} })
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value} })
 #define OBJ_VAL(object) ((Value){ VAL_OBJ, { .obj = (Obj*) object } })
 
@@ -106,6 +114,7 @@ typedef struct{
 
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
+void appendValueArray(ValueArray* array, const Value* values, int count);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
 bool valuesEqual(Value a, Value b);
@@ -117,5 +126,8 @@ void freeByteArray(ByteArray* bytes);
 uint32_t hashValue(Value);
 
 ObjString* strValue(Value obj);
+void forgetNumberString(ObjString* string);
+void appendValue(ObjBuilder* builder, Value value);
+ObjString* joinValues(Value* values, int count, ObjString* separator);
 
 #endif
\ No newline at end of file
@@ -7,13 +7,36 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "file.h"
+#include "list.h"
 #include "map.h"
 #include "memory.h"
 #include "object.h"
 #include "runtime.h"
+#include "shape.h"
 #include "value.h"
 #include "vm.h"
 
+VM vm;
+
+#ifdef DEBUG_INLINE_CACHE
+// Inline cache hits and misses, indexed by opcode
+static uint64_t cacheHits[UINT8_COUNT];
+static uint64_t cacheMisses[UINT8_COUNT];
+
+static void printCacheStats(){
+    const char* names[] = { "get property", "set property", "invoke" };
+    OpCode ops[] = { OP_GET_PROPERTY, OP_SET_PROPERTY, OP_INVOKE };
+
+    fprintf(stderr, "== inline caches ==\n");
+    for(int i = 0; i < 3; i++){
+        fprintf(stderr, "%-13s hits %12llu  misses %12llu\n", names[i],
+            (unsigned long long)cacheHits[ops[i]],
+            (unsigned long long)cacheMisses[ops[i]]);
+    }
+}
+#endif
+
 void initVM(){
     if(vm.inited){
         return;
@@ -24,21 +47,70 @@ void initVM(){
     vm.stackCapacity = 0;
 
     resetStack();
-    vm.objects = NULL;
+    for(int i = 0; i < SLAB_CLASS_COUNT; i++){
+        vm.pages[i] = NULL;
+        vm.freeSlots[i] = NULL;
+        vm.sweepPages[i] = NULL;
+    }
+    vm.youngCount = 0;
+    vm.youngCapacity = 0;
+    vm.youngObjects = NULL;
 
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.totalAllocated = 0;
+    vm.nextGC = GC_INITIAL_HEAP;
+    vm.youngBytes = 0;
+    vm.nurserySize = NURSERY_SIZE;
 
     vm.grayCapacity = 0;
     vm.grayCount = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.minorGC = false;
+
+    vm.gcPhase = GC_IDLE;
+    vm.unsweptPages = 0;
+    vm.markedBytes = 0;
+    vm.sweptBytes = 0;
+    vm.liveBytes = 0;
+    vm.gcStepBytes = 0;
+    vm.gcPauseTarget = GC_PAUSE_TARGET;
+    vm.gcMaxPause = 0;
+    vm.gcTotalPause = 0;
+    vm.gcGrowFactor = GC_HEAP_GROW_FACTOR;
+    vm.gcThreads = 1;
+    vm.gcPauseCount = 0;
+    vm.gcFullCount = 0;
+    vm.gcMinorCount = 0;
+    vm.gcCompactCount = 0;
+    vm.compactPending = false;
+    vm.freeTemporaries = true;
+    vm.temporariesFreed = 0;
+    vm.freshString = NULL;
+
+    initTable(&vm.globalNames);
+    initValueArray(&vm.globalValues);
+    initInternTable(&vm.strings);
+    vm.internMax = STRING_INTERN_MAX;
     initTable(&vm.constants);
+    initTable(&vm.listMethods);
+    initTable(&vm.fileMethods);
+    initTable(&vm.builderMethods);
+    initTable(&vm.stringMethods);
+    for(int i = 0; i < NUMBER_STRING_CACHE; i++){
+        vm.numberStrings[i] = NULL;
+    }
 
     vm.inited = true;
+    reserveStack(STACK_HEADROOM);
     registerBuiltInFunctions();
+    initListNativeMethods(&vm.listMethods);
+    initFileNativeMethods(&vm.fileMethods);
+    initBuilderNativeMethods(&vm.builderMethods);
+    initStringNativeMethods(&vm.stringMethods);
 }
 
 void resetStack(){
@@ -76,486 +148,981 @@ void runtimeError(const char* format, ...){
 // Foreign Function Interface
 void defineNative(const char* name, NativeFn function){
     ObjString* string = copyString(name, (int)strlen(name));
-    ObjNative* native = newNative(function);
     push(OBJ_VAL(string));
+    ObjNative* native = newNative(function);
     push(OBJ_VAL(native));
-    tableSet(&vm.globals, string, OBJ_VAL(native));
+    int slot = globalSlot(string);
+    vm.globalValues.values[slot] = OBJ_VAL(native);
     pop();
     pop();
 }
 
+// Slot of the global variable `name`, adding an undefined one the first
+// time the name is seen
+int globalSlot(ObjString* name){
+    Value slot;
+    if(tableGet(&vm.globalNames, name, &slot)){
+        return (int) AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, EMPTY_VAL);
+    tableSet(&vm.globalNames, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+// Name of the global variable in `slot`, for error messages
+ObjString* globalName(int slot){
+    for(int i = 0; i < vm.globalNames.capacity; i++){
+        Entry* entry = &vm.globalNames.entires[i];
+        if(entry->key != NULL && (int) AS_NUMBER(entry->value) == slot){
+            return entry->key;
+        }
+    }
+    return NULL;
+}
+
 
 void freeVM(){
     if(!vm.inited){
         return;
     }
 
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
+    freeTable(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
+    freeInternTable(&vm.strings);
     freeTable(&vm.constants);
+    freeTable(&vm.listMethods);
+    freeTable(&vm.fileMethods);
+    freeTable(&vm.builderMethods);
+    freeTable(&vm.stringMethods);
 
     freeObjects();
+
+#ifdef DEBUG_PROFILE_OPCODES
+    printOpcodeProfile();
+#endif
+#ifdef DEBUG_INLINE_CACHE
+    printCacheStats();
+#endif
 }
 
 InterpretResult run(){
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    register uint8_t* ip = frame->ip;
-    
+    // Interpreter state lives in locals so the compiler can keep it in
+    // registers. It is written back to `vm` (STORE_FRAME) before anything
+    // that may allocate, call, return or report an error, and re-read
+    // afterwards (LOAD_FRAME / LOAD_STACK).
+    CallFrame* frame;
+    register uint8_t* ip;
+    register Value* sp;
+    Value* slots;
+    Value* constants;
+    InlineCache* caches;
+
+    #define LOAD_FRAME() \
+        do { \
+            frame = &vm.frames[vm.frameCount - 1]; \
+            ip = frame->ip; \
+            slots = frame->slots; \
+            constants = frame->closure->function->chunk.constants.values; \
+            caches = frame->closure->function->chunk.caches; \
+        } while (false)
+
+    // The stack only moves when callFn() reserves a new frame, so after
+    // other helpers just the top needs re-reading.
+    #define LOAD_STACK() \
+        do { \
+            sp = vm.stackTop; \
+        } while (false)
+
+    #define STORE_FRAME() \
+        do { \
+            frame->ip = ip; \
+            vm.stackTop = sp; \
+        } while (false)
+
+    // Stack space for a frame is reserved by callFn(), so pushes in the
+    // loop never need a capacity check.
+    #define PUSH(value) (*sp++ = (value))
+    #define POP()       (*--sp)
+    #define PEEK(distance) (sp[-1 - (distance)])
+
+    #define RUNTIME_ERROR(...) \
+        do { \
+            STORE_FRAME(); \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+
+    // Compaction moves objects, so it waits for a point where the
+    // interpreter holds none outside the VM's state
+    #define SAFEPOINT() \
+        do { \
+            if(vm.compactPending){ \
+                STORE_FRAME(); \
+                compactHeap(); \
+                LOAD_FRAME(); \
+                LOAD_STACK(); \
+            } \
+        } while (false)
+
     #define READ_BYTE() (*ip++)
 
-    #define READ_CONSTANT() ( frame->closure->function->chunk.constants.values[READ_BYTE()] )
+    #define READ_CONSTANT() ( constants[READ_BYTE()] )
 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
 
     #define READ_SHORT() \
         ( ip += 2, (uint16_t)((ip[-2] << 8 ) | ip[-1] ))
 
-    // TODO: Optimize inplace stack binary operation
-    #define BINARY_OP(valueType, op) \
+    #define READ_CACHE() ( &caches[READ_SHORT()] )
+
+    #ifdef DEBUG_INLINE_CACHE
+        #define CACHE_HIT(op)   (cacheHits[op]++)
+        #define CACHE_MISS(op)  (cacheMisses[op]++)
+    #else
+        #define CACHE_HIT(op)   do { } while (false)
+        #define CACHE_MISS(op)  do { } while (false)
+    #endif
+
+    #define READ_CONSTANT_LONG() \
+        ( ip += 3, constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)] )
+
+    // Quickening: once a generic arithmetic or comparison instruction has
+    // seen two numbers it rewrites its opcode in the chunk to the _NUM form.
+    // That form only guards that both operands are still numbers; on a miss
+    // it rewrites the generic opcode back and re-executes it.
+    #define QUICKEN(opcode) (ip[-1] = (opcode))
+
+    #define DEQUICKEN(opcode) \
+        do { \
+            ip[-1] = (opcode); \
+            ip--; \
+            DISPATCH(); \
+        } while (false)
+
+    #define NUMBER_OPERANDS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+
+    #define BINARY_OP(valueType, op, quickened) \
         do { \
-            if(!IS_NUMBER(peek_stack(0)) || !IS_NUMBER(peek_stack(1))) { \
-                frame->ip = ip; \
-                runtimeError("Operand must be a number."); \
-                return INTERPRET_RUNTIME_ERROR; \
+            if(!NUMBER_OPERANDS()) { \
+                RUNTIME_ERROR("Operand must be a number."); \
             }   \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push( valueType( a op b ) ); \
+            double b = AS_NUMBER(POP()); \
+            sp[-1] = valueType( AS_NUMBER(sp[-1]) op b ); \
+            QUICKEN(quickened); \
         } while (false)
 
-    for(;;){
-        #ifdef DEBUG_TRACE_EXECUTION
-            printf("          ");
-            for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
-            }
-            printf("\n");
+    #define NUMBER_OP(valueType, op, generic) \
+        do { \
+            if(!NUMBER_OPERANDS()) DEQUICKEN(generic); \
+            double b = AS_NUMBER(POP()); \
+            sp[-1] = valueType( AS_NUMBER(sp[-1]) op b ); \
+        } while (false)
 
-            disassembleInstruction(&frame->closure->function->chunk,
-                                    (int)(frame->ip - frame->closure->function->chunk.code));
-        #endif
-
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()){
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                // printValue(constant);
-                // printf("\n");
-                break;
-            }
+    #ifdef DEBUG_TRACE_EXECUTION
+        #define TRACE_INSTRUCTION() \
+            do { \
+                printf("          "); \
+                for(Value* slot = vm.stack; slot < sp; slot++){ \
+                    printf("[ "); \
+                    printValue(*slot); \
+                    printf(" ]"); \
+                } \
+                printf("\n"); \
+                disassembleInstruction(&frame->closure->function->chunk, \
+                                        (int)(ip - frame->closure->function->chunk.code)); \
+            } while (false)
+    #else
+        #define TRACE_INSTRUCTION() do { } while (false)
+    #endif
+
+    #ifdef DEBUG_PROFILE_OPCODES
+        #define PROFILE_INSTRUCTION() profileOpcode(*ip)
+    #else
+        #define PROFILE_INSTRUCTION() do { } while (false)
+    #endif
+
+    LOAD_FRAME();
+    LOAD_STACK();
+
+    // Every handler ends with DISPATCH(). With computed goto each handler
+    // jumps straight to the next handler, giving the branch predictor one
+    // indirect branch per opcode instead of a single shared one.
+    #ifdef COMPUTED_GOTO
+        // Bytes that aren't opcodes land on the error at DEFAULT_CODE
+        static void* dispatchTable[UINT8_MAX + 1] = {
+            [0 ... UINT8_MAX]   = &&code_UNKNOWN,
+            [OP_CONSTANT_LONG]  = &&code_CONSTANT_LONG,
+            [OP_CONSTANT]       = &&code_CONSTANT,
+            [OP_NULL]           = &&code_NULL,
+            [OP_TRUE]           = &&code_TRUE,
+            [OP_FALSE]          = &&code_FALSE,
+            [OP_EQUAL]          = &&code_EQUAL,
+            [OP_GREATER]        = &&code_GREATER,
+            [OP_LESS]           = &&code_LESS,
+            [OP_ADD]            = &&code_ADD,
+            [OP_MINUS]          = &&code_MINUS,
+            [OP_MULTIPLY]       = &&code_MULTIPLY,
+            [OP_DIVIDE]         = &&code_DIVIDE,
+            [OP_MOD]            = &&code_MOD,
+            [OP_NOT]            = &&code_NOT,
+            [OP_NEGATE]         = &&code_NEGATE,
+            [OP_PRINT]          = &&code_PRINT,
+            [OP_POP]            = &&code_POP,
+            [OP_JUMP_IF_FALSE]  = &&code_JUMP_IF_FALSE,
+            [OP_JUMP]           = &&code_JUMP,
+            [OP_LOOP]           = &&code_LOOP,
+            [OP_RETURN]         = &&code_RETURN,
+            [OP_DEFINE_GLOBAL]  = &&code_DEFINE_GLOBAL,
+            [OP_GET_GLOBAL]     = &&code_GET_GLOBAL,
+            [OP_SET_GLOBAL]     = &&code_SET_GLOBAL,
+            [OP_GET_LOCAL]      = &&code_GET_LOCAL,
+            [OP_SET_LOCAL]      = &&code_SET_LOCAL,
+            [OP_GET_UPVALUE]    = &&code_GET_UPVALUE,
+            [OP_SET_UPVALUE]    = &&code_SET_UPVALUE,
+            [OP_CALL]           = &&code_CALL,
+            [OP_CLOSURE]        = &&code_CLOSURE,
+            [OP_CLOSE_UPVALUE]  = &&code_CLOSE_UPVALUE,
+            [OP_CLASS]          = &&code_CLASS,
+            [OP_SET_PROPERTY]   = &&code_SET_PROPERTY,
+            [OP_GET_PROPERTY]   = &&code_GET_PROPERTY,
+            [OP_METHOD]         = &&code_METHOD,
+            [OP_INVOKE]         = &&code_INVOKE,
+            [OP_INHERIT]        = &&code_INHERIT,
+            [OP_GET_SUPER]      = &&code_GET_SUPER,
+            [OP_SUPER_INVOKE]   = &&code_SUPER_INVOKE,
+            [OP_LIST]           = &&code_LIST,
+            [OP_MAP]            = &&code_MAP,
+            [OP_INDEX]          = &&code_INDEX,
+            [OP_SET_INDEX]      = &&code_SET_INDEX,
+            [OP_DUP]            = &&code_DUP,
+            [OP_ADD_TEMP]       = &&code_ADD_TEMP,
+
+            [OP_NOT_EQUAL]                  = &&code_NOT_EQUAL,
+            [OP_GREATER_EQUAL]              = &&code_GREATER_EQUAL,
+            [OP_LESS_EQUAL]                 = &&code_LESS_EQUAL,
+            [OP_ADD_LOCALS]                 = &&code_ADD_LOCALS,
+            [OP_SET_LOCAL_POP]              = &&code_SET_LOCAL_POP,
+            [OP_INCREMENT_LOCAL]            = &&code_INCREMENT_LOCAL,
+            [OP_LESS_LOCAL_CONSTANT_JUMP]   = &&code_LESS_LOCAL_CONSTANT_JUMP,
+
+            [OP_ADD_NUM]            = &&code_ADD_NUM,
+            [OP_ADD_TEMP_NUM]       = &&code_ADD_TEMP_NUM,
+            [OP_MINUS_NUM]          = &&code_MINUS_NUM,
+            [OP_MULTIPLY_NUM]       = &&code_MULTIPLY_NUM,
+            [OP_DIVIDE_NUM]         = &&code_DIVIDE_NUM,
+            [OP_MOD_NUM]            = &&code_MOD_NUM,
+            [OP_LESS_NUM]           = &&code_LESS_NUM,
+            [OP_GREATER_NUM]        = &&code_GREATER_NUM,
+            [OP_LESS_EQUAL_NUM]     = &&code_LESS_EQUAL_NUM,
+            [OP_GREATER_EQUAL_NUM]  = &&code_GREATER_EQUAL_NUM,
+            [OP_EQUAL_NUM]          = &&code_EQUAL_NUM,
+            [OP_NOT_EQUAL_NUM]      = &&code_NOT_EQUAL_NUM,
+        };
+
+        #define INTERPRET_LOOP  DISPATCH();
+        #define CASE_CODE(name) code_##name
+        #define DEFAULT_CODE    code_UNKNOWN
+        #define DISPATCH() \
+            do { \
+                TRACE_INSTRUCTION(); \
+                PROFILE_INSTRUCTION(); \
+                goto *dispatchTable[READ_BYTE()]; \
+            } while (false)
+    #else
+        #define INTERPRET_LOOP \
+            loop: \
+                TRACE_INSTRUCTION(); \
+                PROFILE_INSTRUCTION(); \
+                switch (READ_BYTE())
+        #define CASE_CODE(name) case OP_##name
+        #define DEFAULT_CODE    default
+        #define DISPATCH()      goto loop
+    #endif
+
+    INTERPRET_LOOP
+    {
+        CASE_CODE(CONSTANT): {
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+        }
 
-            case OP_NULL: push(NULL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
+        CASE_CODE(CONSTANT_LONG): {
+            PUSH(READ_CONSTANT_LONG());
+            DISPATCH();
+        }
 
-            // Comparison Operators
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a,b)));
-                break;
+        CASE_CODE(NULL): PUSH(NULL_VAL); DISPATCH();
+        CASE_CODE(TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE_CODE(FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+
+        // Comparison Operators
+        CASE_CODE(EQUAL): {
+            if(NUMBER_OPERANDS()) QUICKEN(OP_EQUAL_NUM);
+            Value b = POP();
+            sp[-1] = BOOL_VAL(valuesEqual(sp[-1], b));
+            DISPATCH();
+        }
+        CASE_CODE(LESS):           BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+        CASE_CODE(GREATER):        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+        
+        // Binary Operators
+        CASE_CODE(ADD):{
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                STORE_FRAME();
+                concatenate();
+                LOAD_STACK();
+            } else if(NUMBER_OPERANDS()) {
+                double b = AS_NUMBER(POP());
+                sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) + b);
+                QUICKEN(OP_ADD_NUM);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_LESS:           BINARY_OP(BOOL_VAL, <); break;
-            case OP_GREATER:        BINARY_OP(BOOL_VAL, >); break;
-            
-            // Binary Operators
-            case OP_ADD:{
-                if (IS_STRING(peek_stack(0)) && IS_STRING(peek_stack(1))) {
-                    concatenate();
-                } else if(IS_NUMBER(peek_stack(0)) && IS_NUMBER(peek_stack(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    frame->ip = ip;
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }        
-            case OP_MINUS:          BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY:       BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:         BINARY_OP(NUMBER_VAL, /); break;
-            case OP_MOD:{
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                if(b == 0){
-                    frame->ip = ip;
-                    runtimeError("ZeroDivisionError: modulo by zero is invalid.");
-                    return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }        
+        CASE_CODE(ADD_TEMP):{
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                // Only the stack held a string the last concatenation
+                // created, it is dead once copied into the result
+                ObjString* temporary = AS_STRING(PEEK(1));
+                bool fresh = temporary == vm.freshString;
+                STORE_FRAME();
+                concatenate();
+                // The result may be the temporary itself, found interned,
+                // or a rope still pointing to it
+                ObjString* result = AS_STRING(vm.stackTop[-1]);
+                if(fresh && vm.freeTemporaries && result != temporary && !IS_ROPE(result)){
+                    freeTemporary((Obj*) temporary);
                 }
-                push( NUMBER_VAL( fmod(a, b) ) ); 
-                break;
+                LOAD_STACK();
+            } else if(NUMBER_OPERANDS()) {
+                double b = AS_NUMBER(POP());
+                sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) + b);
+                QUICKEN(OP_ADD_TEMP_NUM);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
+            DISPATCH();
+        }
+        CASE_CODE(MINUS):          BINARY_OP(NUMBER_VAL, -, OP_MINUS_NUM); DISPATCH();
+        CASE_CODE(MULTIPLY):       BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE_CODE(DIVIDE):         BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+        CASE_CODE(MOD):{
+            if(NUMBER_OPERANDS()) QUICKEN(OP_MOD_NUM);
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            if(b == 0){
+                RUNTIME_ERROR("ZeroDivisionError: modulo by zero is invalid.");
+            }
+            PUSH( NUMBER_VAL( fmod(a, b) ) ); 
+            DISPATCH();
+        }
 
-            case OP_NOT:
-                *(vm.stackTop-1) = (BOOL_VAL(isFalsey(*(vm.stackTop-1))));
-                break;
-
-            // Unary Operators
-            case OP_NEGATE:         
-                if(!IS_NUMBER(peek_stack(0))){
-                    frame->ip = ip;
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                *(vm.stackTop-1) = NUMBER_VAL(-AS_NUMBER(*(vm.stackTop-1))); 
-                break;
+        CASE_CODE(NOT):
+            sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+            DISPATCH();
 
-            case OP_PRINT:{
-                printValue(pop());
-                printf("\n");
-                break;
+        // Unary Operators
+        CASE_CODE(NEGATE):         
+            if(!IS_NUMBER(PEEK(0))){
+                RUNTIME_ERROR("Operand must be a number.");
             }
+            sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1])); 
+            DISPATCH();
 
-            case OP_POP: {
-                pop();
-                break;
-            }
+        CASE_CODE(PRINT):{
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
 
-            case OP_DEFINE_GLOBAL:{
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek_stack(0));
-                pop();
-                break;
-            }
+        CASE_CODE(POP): {
+            sp--;
+            DISPATCH();
+        }
 
-            case OP_SET_GLOBAL:{
-                ObjString* name = READ_STRING();
-                // Implicit declaration - keep only below line
-                tableSet(&vm.globals, name, peek_stack(0));
-
-                // Explicit declaration - users need to specify `var <identifier>` to declare variable
-                // if( tableSet(&vm.globals, name, peek_stack(0)) ){
-                //     tableDelete(&vm.globals, name);
-                //     frame->ip = ip;
-                //     runtimeError("Undefined variable '%s'.", name->chars);
-                //     return INTERPRET_RUNTIME_ERROR;
-                // }
-                break;
-            }
+        CASE_CODE(DEFINE_GLOBAL):{
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
+        }
 
-            case OP_GET_GLOBAL:{
-                ObjString* name = READ_STRING();
-                Value value;
+        CASE_CODE(SET_GLOBAL):{
+            uint16_t slot = READ_SHORT();
 
-                if(!tableGet(&vm.globals, name, &value)){
-                    frame->ip = ip;
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            // Explicit declaration - users need to specify `var <identifier>` to declare variable
+            // if(IS_EMPTY(vm.globalValues.values[slot])){
+            //     RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+            // }
 
-                push(value);
-                break;
-            }
+            // Implicit declaration - keep only below line
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
 
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
+        CASE_CODE(GET_GLOBAL):{
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
 
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek_stack(0);
-                break;
+            if(IS_EMPTY(value)){
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
             }
 
-            case OP_GET_UPVALUE:{
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
+            PUSH(value);
+            DISPATCH();
+        }
 
-            case OP_SET_UPVALUE:{
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek_stack(0);
-                break;
-            }
+        CASE_CODE(GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if(isFalsey(peek_stack(0))) ip += offset;
-                break;
-            }
+        CASE_CODE(SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
 
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                ip += offset;
-                break;
-            }
+        CASE_CODE(GET_UPVALUE):{
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
 
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                ip -= offset;
-                break;
-            }
+        CASE_CODE(SET_UPVALUE):{
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            WRITE_BARRIER(upvalue);
+            DISPATCH();
+        }
 
-            case OP_CALL:{
-                int argCount = READ_BYTE();
-                frame->ip = ip;
-                if(!callValue(peek_stack(argCount), argCount)){
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
-            }
+        CASE_CODE(JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if(isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
 
-            case OP_LIST:{
-                int itemCount = READ_BYTE();
-                ObjList* list = newList();
-                for(int i=0; i < itemCount; i++){
-                    writeValueArray(&list->array, pop());
-                }
+        CASE_CODE(JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
 
-                ObjList* reversedList = newList();
-                for(int i=itemCount - 1; i >= 0; i--){
-                    writeValueArray(&reversedList->array, list->array.values[i]);
-                }
+        CASE_CODE(LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            SAFEPOINT();
+            DISPATCH();
+        }
 
-                push(OBJ_VAL(reversedList));
-                break;
+        CASE_CODE(CALL):{
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if(!callValue(PEEK(argCount), argCount)){
+                return INTERPRET_RUNTIME_ERROR;
             }
+            LOAD_FRAME();
+            LOAD_STACK();
+            SAFEPOINT();
+            DISPATCH();
+        }
 
-            case OP_MAP:{
-                int itemCounts = READ_BYTE();                
-                ObjMap* map = newMap();
+        CASE_CODE(LIST):{
+            int itemCount = READ_BYTE();
+            STORE_FRAME();
+            ObjList* list = newList();
+            // keep the list reachable while its array is allocated, the
+            // items stay on the stack below it until they are copied
+            PUSH(OBJ_VAL(list));
+            STORE_FRAME();
+            appendValueArray(&list->array, &PEEK(itemCount), itemCount);
+            WRITE_BARRIER(list);
+
+            sp -= itemCount;
+            sp[-1] = OBJ_VAL(list);
+            DISPATCH();
+        }
 
-                for(int i = itemCounts - 1; i >= 0; i = i - 1){
-                    // Check item type of key
-                    if(!IS_STRING(peek_stack(2*i + 1)) && !IS_NUMBER(peek_stack(2*i + 1))){
-                        frame->ip = ip;
-                        runtimeError("Map keys must be string or number type.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
+        CASE_CODE(MAP):{
+            int itemCounts = READ_BYTE();                
+            STORE_FRAME();
+            ObjMap* map = newMap();
+            // keep the map reachable while inserting
+            PUSH(OBJ_VAL(map));
+            STORE_FRAME();
+
+            for(int i = itemCounts - 1; i >= 0; i = i - 1){
+                // Check item type of key
+                if(!IS_STRING(PEEK(2*i + 2)) && !IS_NUMBER(PEEK(2*i + 2))){
+                    RUNTIME_ERROR("Map keys must be string or number type.");
+                }
 
-                    Value value = peek_stack(2*i);
-                    Value key = peek_stack(2*i + 1);
+                Value value = PEEK(2*i + 1);
+                Value key = PEEK(2*i + 2);
 
-                    mapSet(map, key, value);
-                }
+                mapSet(map, key, value);
+            }
 
-                // remove elements from top of stack
-                vm.stackTop -= 2 * itemCounts;
+            // remove elements from top of stack
+            sp -= 2 * itemCounts + 1;
 
-                push(OBJ_VAL(map));
-                break;
+            PUSH(OBJ_VAL(map));
+            DISPATCH();
+        }
+
+        CASE_CODE(INDEX):{
+            int item_count = READ_BYTE();
+            
+            // end Index
+            Value endIndex = NULL_VAL;
+            if(item_count > 1){
+                endIndex = PEEK(0);
             }
 
-            case OP_INDEX:{
-                int item_count = READ_BYTE();
-                
-                // end Index
-                Value endIndex = NULL_VAL;
-                if(item_count > 1){
-                    endIndex = pop();
-                }
+            // Start index
+            Value index = PEEK(item_count - 1);
+            Value object = PEEK(item_count);
 
-                // Start index
-                Value index = pop();
-                Value object = pop();
-                if(!handleIndexOperator(object, index, endIndex)){
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            // Operands stay on the stack (reachable) until the result is pushed
+            STORE_FRAME();
+            if(!handleIndexOperator(object, index, endIndex)){
+                return INTERPRET_RUNTIME_ERROR;
             }
+            LOAD_STACK();
+            Value result = POP();
+            sp -= item_count + 1;
+            PUSH(result);
+            DISPATCH();
+        }
 
-            case OP_SET_INDEX:{
-                Value result = pop();
-                Value index = pop(); 
-                Value object = peek_stack(0);
+        CASE_CODE(SET_INDEX):{
+            Value result = PEEK(0);
+            Value index = PEEK(1); 
+            Value object = PEEK(2);
 
-                if(!handleIndexSetOperator(object, index, result)){
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                
-                break;
+            STORE_FRAME();
+            if(!handleIndexSetOperator(object, index, result)){
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            sp -= 2;
+            DISPATCH();
+        }
+
+        CASE_CODE(RETURN): {
+            Value result = POP();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if(vm.frameCount == 0){
+                vm.stackTop = slots;
+                return INTERPRET_OK;
             }
 
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if(vm.frameCount == 0){
-                    pop();
-                    return INTERPRET_OK;
+            sp = slots;
+            PUSH(result);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE_CODE(CLOSURE):{
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure* closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+
+            for(int i = 0;i <closure->upvalueCount; i++){
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+
+                if(isLocal){
+                    vm.stackTop = sp;
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+                // captureUpvalue can collect and promote the closure
+                WRITE_BARRIER(closure);
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
             }
+            
+            DISPATCH();
+        }
+
+        CASE_CODE(CLOSE_UPVALUE):{
+            closeUpvalues(sp - 1);
+            sp--;
+            DISPATCH();
+        }
 
-            case OP_CLOSURE:{
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
+        CASE_CODE(CLASS):{
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
 
-                for(int i = 0;i <closure->upvalueCount; i++){
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+        CASE_CODE(GET_PROPERTY):{
+            if(!IS_INSTANCE(PEEK(0)) && !IS_LIST(PEEK(0))){
+                RUNTIME_ERROR("Only instances have property.");
+            }
+            // Get property on Class Objects
+            if(IS_INSTANCE(PEEK(0))){
+                ObjInstance* instance = AS_INSTANCE(PEEK(0));
+                ObjString* name = READ_STRING();
+                InlineCache* cache = READ_CACHE();
+
+                if(cache->shape == instance->shape){
+                    if(cache->index >= 0){
+                        CACHE_HIT(OP_GET_PROPERTY);
+                        sp[-1] = instance->fields[cache->index];
+                        DISPATCH();
+                    } else if(cache->index == CACHE_METHOD){
+                        CACHE_HIT(OP_GET_PROPERTY);
+                        STORE_FRAME();
+                        ObjBoundMethod* bound = newBoundMethod(PEEK(0), AS_CLOSURE(cache->method));
+                        sp[-1] = OBJ_VAL(bound);
+                        DISPATCH();
+                    }
+                }
+                CACHE_MISS(OP_GET_PROPERTY);
 
-                    if(isLocal){
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                Value value;
+                if(instance->shape != NULL){
+                    int index = shapeFieldIndex(instance->shape, name);
+                    if(index != -1){
+                        cache->shape = instance->shape;
+                        cache->transition = NULL;
+                        cache->index = index;
+                        WRITE_BARRIER(frame->closure->function);
+                        sp[-1] = instance->fields[index];
+                        DISPATCH();
                     }
+                } else if(tableGet(&instance->dictionary, name, &value)){
+                    sp[-1] = value;
+                    DISPATCH();
+                }
 
+                Value method;
+                if(!tableGet(&instance->kclass->methods, name, &method)){
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                }
+                if(instance->shape != NULL){
+                    cache->shape = instance->shape;
+                    cache->transition = NULL;
+                    cache->index = CACHE_METHOD;
+                    cache->method = method;
+                    WRITE_BARRIER(frame->closure->function);
                 }
+
+                STORE_FRAME();
+                ObjBoundMethod* bound = newBoundMethod(PEEK(0), AS_CLOSURE(method));
+                sp[-1] = OBJ_VAL(bound);
+                DISPATCH();
+            } 
+            // Get property on List object
+            else {
+                ObjString* name = READ_STRING();
+                ip += 2; // inline cache, only used for instances
                 
-                break;
+                Value value;
+                if(tableGet(&vm.listMethods, name, &value)){
+                    sp[-1] = value;
+                    DISPATCH();
+                } else {
+                    RUNTIME_ERROR("List method '%s' not found.", name->chars);
+                }
             }
+        }
 
-            case OP_CLOSE_UPVALUE:{
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+        CASE_CODE(SET_PROPERTY):{
+            if(!IS_INSTANCE(PEEK(1))){
+                RUNTIME_ERROR("Only instances have fields.");
             }
 
-            case OP_CLASS:{
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+
+            if(cache->shape == instance->shape && cache->index >= 0){
+                CACHE_HIT(OP_SET_PROPERTY);
+                if(cache->transition != NULL){
+                    // Adds the field, moving the instance to the next shape
+                    if(cache->index == instance->fieldCapacity){
+                        STORE_FRAME();
+                        growInstanceFields(instance);
+                    }
+                    instance->fields[cache->index] = PEEK(0);
+                    instance->shape = cache->transition;
+                } else {
+                    instance->fields[cache->index] = PEEK(0);
+                }
+                WRITE_BARRIER(instance);
+            } else {
+                CACHE_MISS(OP_SET_PROPERTY);
+                STORE_FRAME();
+                ObjShape* shape = instance->shape;
+                bool isNewField = instanceSetField(instance, name, PEEK(0));
+                if(instance->shape != NULL){
+                    cache->shape = isNewField ? shape : instance->shape;
+                    cache->transition = isNewField ? instance->shape : NULL;
+                    cache->index = shapeFieldIndex(instance->shape, name);
+                    WRITE_BARRIER(frame->closure->function);
+                }
             }
 
-            case OP_GET_PROPERTY:{
-                if(!IS_INSTANCE(peek_stack(0)) && !IS_LIST(peek_stack(0))){
-                    frame->ip = ip;
-                    runtimeError("Only instances have property.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // Get property on Class Objects
-                if(IS_INSTANCE(peek_stack(0))){
-                    ObjInstance* instance = AS_INSTANCE(peek_stack(0));
-                    ObjString* name = READ_STRING();
-
-                    Value value;
-                    if(tableGet(&instance->fields, name, &value)){
-                        pop();
-                        push(value);
-                        break;
-                    }
-                    
-                    if(!bindMethod(instance->kclass, name)){
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    break;
-                } 
-                // Get property on List object
-                else if(IS_LIST(peek_stack(0))){
-                    ObjList* list = AS_LIST(peek_stack(0));
-                    ObjString* name = READ_STRING();
-                    
-                    Value value;
-                    if(tableGet(&list->nativeMethods, name, &value)){
-                        pop();
-                        push(value);
-                        break;
-                    } else {
-                        frame->ip = ip;
-                        runtimeError("List method '%s' not found.", name->chars);
+            Value value = POP();
+            sp[-1] = value;
+            DISPATCH();             
+        }
+
+        CASE_CODE(METHOD):{
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(name);
+            LOAD_STACK();
+            DISPATCH();
+        }
+
+        CASE_CODE(INVOKE):{
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = PEEK(argCount);
+
+            if(IS_INSTANCE(receiver)){
+                ObjInstance* instance = AS_INSTANCE(receiver);
+                if(cache->shape == instance->shape && cache->index == CACHE_METHOD){
+                    CACHE_HIT(OP_INVOKE);
+                    STORE_FRAME();
+                    if(!callFn(AS_CLOSURE(cache->method), argCount)){
                         return INTERPRET_RUNTIME_ERROR;
                     }
+                    LOAD_FRAME();
+                    LOAD_STACK();
+                    DISPATCH();
                 }
+                CACHE_MISS(OP_INVOKE);
             }
 
-            case OP_SET_PROPERTY:{
-                if(!IS_INSTANCE(peek_stack(1))){
-                    frame->ip = ip;
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            STORE_FRAME();
+            if(!invoke(method, argCount, cache)){
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            LOAD_STACK();
+            DISPATCH();
+        }
 
-                ObjInstance* instance = AS_INSTANCE(peek_stack(1));
-                tableSet(&instance->fields, READ_STRING(), peek_stack(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;             
+        CASE_CODE(INHERIT):{
+            Value superclass = PEEK(1);
+            if(!IS_CLASS(superclass)){
+                RUNTIME_ERROR("Superclass must be a class.");
             }
 
-            case OP_METHOD:{
-                defineMethod(READ_STRING());
-                break;
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+
+            STORE_FRAME();
+            tableAddAll(
+                &AS_CLASS(superclass)->methods,
+                &subclass->methods
+            );
+            WRITE_BARRIER(subclass);
+            sp--;
+            DISPATCH();
+        }
+
+        CASE_CODE(GET_SUPER):{
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(POP());
+
+            STORE_FRAME();
+            if(!bindMethod(superclass, name)){
+                return INTERPRET_RUNTIME_ERROR;
             }
+            LOAD_STACK();
+            DISPATCH();
+        }
 
-            case OP_INVOKE:{
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                frame->ip = ip;
-                if(!invoke(method, argCount)){
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+        CASE_CODE(SUPER_INVOKE):{
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(POP());
+            
+            STORE_FRAME();
+            if(!invokeFromClass(superclass, method, argCount)){
+                return INTERPRET_RUNTIME_ERROR;
             }
 
-            case OP_INHERIT:{
-                Value superclass = peek_stack(1);
-                if(!IS_CLASS(superclass)){
-                    frame->ip = ip;
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            LOAD_FRAME();
+            LOAD_STACK();
+            DISPATCH();
+        }
 
-                ObjClass* subclass = AS_CLASS(peek_stack(0));
+        CASE_CODE(DUP): {
+            Value top = PEEK(0);
+            PUSH(top);
+            DISPATCH();
+        }
 
-                tableAddAll(
-                    &AS_CLASS(superclass)->methods,
-                    &subclass->methods
-                );
-                pop();
-                break;
+        // Superinstructions. Each behaves exactly like the sequence it
+        // replaces (see OpCode), errors included.
+        CASE_CODE(NOT_EQUAL): {
+            if(NUMBER_OPERANDS()) QUICKEN(OP_NOT_EQUAL_NUM);
+            Value b = POP();
+            sp[-1] = BOOL_VAL(!valuesEqual(sp[-1], b));
+            DISPATCH();
+        }
+
+        // `a >= b` and `a <= b` stay the negation of `a < b` and `a > b`,
+        // which differs from the C operators for NaN
+        CASE_CODE(GREATER_EQUAL): {
+            if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
+            double b = AS_NUMBER(POP());
+            sp[-1] = BOOL_VAL(!(AS_NUMBER(sp[-1]) < b));
+            QUICKEN(OP_GREATER_EQUAL_NUM);
+            DISPATCH();
+        }
 
-            case OP_GET_SUPER:{
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
+        CASE_CODE(LESS_EQUAL): {
+            if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            double b = AS_NUMBER(POP());
+            sp[-1] = BOOL_VAL(!(AS_NUMBER(sp[-1]) > b));
+            QUICKEN(OP_LESS_EQUAL_NUM);
+            DISPATCH();
+        }
 
-                if(!bindMethod(superclass, name)){
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+        CASE_CODE(ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if(IS_NUMBER(a) && IS_NUMBER(b)){
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else if(IS_STRING(a) && IS_STRING(b)){
+                PUSH(a);
+                PUSH(b);
+                STORE_FRAME();
+                concatenate();
+                LOAD_STACK();
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
+            DISPATCH();
+        }
 
-            case OP_SUPER_INVOKE:{
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                
-                frame->ip = ip;
-                if(!invokeFromClass(superclass, method, argCount)){
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE_CODE(SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            DISPATCH();
+        }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+        // The constant is always a number, checked by the compiler
+        CASE_CODE(INCREMENT_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            Value increment = READ_CONSTANT();
+            if(!IS_NUMBER(slots[slot])){
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
+            slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(increment));
+            DISPATCH();
+        }
 
-            case OP_DUP: {
-                push(peek_stack(0));
-                break;
+        CASE_CODE(LESS_LOCAL_CONSTANT_JUMP): {
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if(!IS_NUMBER(a)){
+                RUNTIME_ERROR("Operand must be a number.");
             }
+            bool less = AS_NUMBER(a) < AS_NUMBER(b);
+            PUSH(BOOL_VAL(less));
+            if(!less) ip += offset;
+            DISPATCH();
+        }
 
-            
+        // Quickened instructions, see QUICKEN
+        CASE_CODE(ADD_NUM):        NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE_CODE(ADD_TEMP_NUM):   NUMBER_OP(NUMBER_VAL, +, OP_ADD_TEMP); DISPATCH();
+        CASE_CODE(MINUS_NUM):      NUMBER_OP(NUMBER_VAL, -, OP_MINUS); DISPATCH();
+        CASE_CODE(MULTIPLY_NUM):   NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE_CODE(DIVIDE_NUM):     NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+        CASE_CODE(LESS_NUM):       NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+        CASE_CODE(GREATER_NUM):    NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE_CODE(EQUAL_NUM):      NUMBER_OP(BOOL_VAL, ==, OP_EQUAL); DISPATCH();
+        CASE_CODE(NOT_EQUAL_NUM):  NUMBER_OP(BOOL_VAL, !=, OP_NOT_EQUAL); DISPATCH();
+
+        CASE_CODE(MOD_NUM): {
+            if(!NUMBER_OPERANDS()) DEQUICKEN(OP_MOD);
+            double b = AS_NUMBER(POP());
+            if(b == 0){
+                RUNTIME_ERROR("ZeroDivisionError: modulo by zero is invalid.");
+            }
+            sp[-1] = NUMBER_VAL(fmod(AS_NUMBER(sp[-1]), b));
+            DISPATCH();
+        }
+
+        CASE_CODE(GREATER_EQUAL_NUM): {
+            if(!NUMBER_OPERANDS()) DEQUICKEN(OP_GREATER_EQUAL);
+            double b = AS_NUMBER(POP());
+            sp[-1] = BOOL_VAL(!(AS_NUMBER(sp[-1]) < b));
+            DISPATCH();
+        }
+
+        CASE_CODE(LESS_EQUAL_NUM): {
+            if(!NUMBER_OPERANDS()) DEQUICKEN(OP_LESS_EQUAL);
+            double b = AS_NUMBER(POP());
+            sp[-1] = BOOL_VAL(!(AS_NUMBER(sp[-1]) > b));
+            DISPATCH();
+        }
+
+        DEFAULT_CODE: {
+            RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
         }
     }
+
+    return INTERPRET_RUNTIME_ERROR;
+
+    #undef LOAD_FRAME
+    #undef LOAD_STACK
+    #undef STORE_FRAME
+    #undef PUSH
+    #undef POP
+    #undef PEEK
+    #undef RUNTIME_ERROR
+    #undef SAFEPOINT
     #undef READ_STRING
     #undef READ_BYTE
     #undef READ_CONSTANT
+    #undef READ_CONSTANT_LONG
+    #undef READ_CACHE
+    #undef CACHE_HIT
+    #undef CACHE_MISS
     #undef BINARY_OP
+    #undef QUICKEN
+    #undef DEQUICKEN
+    #undef NUMBER_OPERANDS
+    #undef NUMBER_OP
     #undef READ_SHORT
+    #undef TRACE_INSTRUCTION
+    #undef PROFILE_INSTRUCTION
+    #undef INTERPRET_LOOP
+    #undef CASE_CODE
+    #undef DEFAULT_CODE
+    #undef DISPATCH
 }
 
 InterpretResult interpret(VM* vm, const char* source){
-    
+    // Room for the values the compiler and the script closure keep on
+    // the stack before the first frame is reserved
+    reserveStack(STACK_HEADROOM);
+
     ObjFunction* function = compile(vm, source);
 
     if(function==NULL) return INTERPRET_COMPILE_ERROR;
@@ -569,30 +1136,40 @@ InterpretResult interpret(VM* vm, const char* source){
     return run();
 }
 
-void push(Value value){
+// Grow the stack so that `needed` more values fit above stackTop
+void reserveStack(size_t needed){
     size_t count = vm.stackTop - vm.stack;
-    if(count == vm.stackCapacity){
-        Value *oldStack = vm.stack;
-
-        size_t oldCapacity = vm.stackCapacity;
-        vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-        vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-        vm.stackTop = vm.stack + count;
-
-        // Ref: https://github.com/lazara5/elox/blob/master/elox/lib/vm.c#L296
-        // the stack moved, recalculate all pointers that point to the old stack
-        if(oldStack != vm.stack){
-            for(int i = 0; i < vm.frameCount; i++){
-                CallFrame* frame = &vm.frames[i];
-                frame->slots = vm.stack + (frame->slots - oldStack);
-            }
+    if(count + needed <= vm.stackCapacity) return;
 
-            for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next){
-                upvalue->location = vm.stack + (upvalue->location - oldStack);
-            }
+    Value *oldStack = vm.stack;
+
+    size_t oldCapacity = vm.stackCapacity;
+    size_t capacity = GROW_CAPACITY(oldCapacity);
+    while(capacity < count + needed){
+        capacity = GROW_CAPACITY(capacity);
+    }
+
+    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, capacity);
+    vm.stackCapacity = capacity;
+    vm.stackTop = vm.stack + count;
+
+    // Ref: https://github.com/lazara5/elox/blob/master/elox/lib/vm.c#L296
+    // the stack moved, recalculate all pointers that point to the old stack
+    if(oldStack != vm.stack){
+        for(int i = 0; i < vm.frameCount; i++){
+            CallFrame* frame = &vm.frames[i];
+            frame->slots = vm.stack + (frame->slots - oldStack);
+        }
+
+        for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next){
+            upvalue->location = vm.stack + (upvalue->location - oldStack);
         }
     }
+}
 
+// Space for pushes is reserved at call boundaries (callFn, interpret), so
+// the stack never moves here.
+void push(Value value){
     *vm.stackTop = value;
     vm.stackTop++;
 }
@@ -610,17 +1187,38 @@ bool isFalsey(Value value){
     return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Long results are ropes, the characters are only copied once needed
 void concatenate(){
     ObjString* b = AS_STRING(peek_stack(0));
     ObjString* a = AS_STRING(peek_stack(1));
     
     int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ObjString* result;
+    if(length >= ROPE_MIN_LENGTH && length > vm.internMax){
+        result = newRope(a, b);
+        vm.freshString = result;
+    } else if(length <= STRING_INLINE_MAX){
+        // Joined on the stack, the object is the only allocation
+        char chars[STRING_INLINE_MAX];
+        memcpy(chars, stringChars(a), a->length);
+        memcpy(chars + a->length, stringChars(b), b->length);
+
+        uint32_t hash;
+        result = findInterned(chars, length, &hash);
+        vm.freshString = NULL;
+        if(result == NULL){
+            result = allocateString(chars, length, hash);
+            vm.freshString = result;
+        }
+    } else {
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, stringChars(a), a->length);
+        memcpy(chars + a->length, stringChars(b), b->length);
+        chars[length] = '\0';
 
-    ObjString* result = takeString(chars, length);
+        result = takeString(chars, length);
+        vm.freshString = result->chars == chars ? result : NULL;
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
@@ -644,6 +1242,10 @@ bool callFn(ObjClosure* closure, int argCount){
         return false;
     }
 
+    // Reserve the callee's whole stack window up front; run() pushes
+    // without checking capacity.
+    reserveStack(closure->function->maxStack + STACK_HEADROOM);
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -651,6 +1253,8 @@ bool callFn(ObjClosure* closure, int argCount){
     return true;
 }
 
+// The receiver stays in the slot below the arguments, keeping it reachable
+// while the method allocates, until the method puts its result there
 bool callNativeObjMethod(Value self, Value callee, int argCount){
     ObjNative* obj = AS_NATIVE_OBJ(callee);
     NativeObjFn native = obj->function.objMethod;
@@ -658,7 +1262,7 @@ bool callNativeObjMethod(Value self, Value callee, int argCount){
         vm.stackTop -= argCount;
         return true;
     } else {
-        runtimeError(AS_STRING(vm.stackTop[- argCount - 1])->chars);
+        runtimeError(AS_CSTRING(vm.stackTop[- argCount - 1]));
         return false;
     }
     // Value result = native(
@@ -689,7 +1293,7 @@ bool callValue(Value callee, int argCount){
                             vm.stackTop -= argCount;
                             return true;
                         } else {
-                            runtimeError(AS_STRING(vm.stackTop[- argCount - 1])->chars);
+                            runtimeError(AS_CSTRING(vm.stackTop[- argCount - 1]));
                             return false;
                         }
                         return true;
@@ -766,6 +1370,7 @@ void closeUpvalues(Value* last){
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -774,6 +1379,7 @@ void defineMethod(ObjString* name){
     Value method = peek_stack(0); // closure
     ObjClass* klass = AS_CLASS(peek_stack(1)); 
     tableSet(&klass->methods, name, method);
+    WRITE_BARRIER(klass);
     pop(); // pop closure
 }
 
@@ -801,7 +1407,9 @@ bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount){
     return callFn(AS_CLOSURE(method), argCount);
 }
 
-bool invoke(ObjString* name, int argCount){
+// Invokes method `name` on the receiver below the arguments. For instance
+// methods the resolved closure is remembered in cache.
+bool invoke(ObjString* name, int argCount, InlineCache* cache){
     Value receiver = peek_stack(argCount);
 
     if(!IS_INSTANCE(receiver) && !IsNativeMethodSupported(receiver)){
@@ -814,19 +1422,30 @@ bool invoke(ObjString* name, int argCount){
         ObjInstance* instance = AS_INSTANCE(receiver);
 
         Value value;
-        if(tableGet(&instance->fields, name, &value)){
+        if(instanceGetField(instance, name, &value)){
             vm.stackTop[-argCount-1] = value;
             return callValue(value, argCount);
         }
 
-        return invokeFromClass(instance->kclass, name, argCount);
+        Value method;
+        if(!tableGet(&instance->kclass->methods, name, &method)){
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        if(instance->shape != NULL){
+            cache->shape = instance->shape;
+            cache->transition = NULL;
+            cache->index = CACHE_METHOD;
+            cache->method = method;
+            // The cache belongs to the calling function
+            WRITE_BARRIER(vm.frames[vm.frameCount - 1].closure->function);
+        }
+        return callFn(AS_CLOSURE(method), argCount);
     } 
     // List method call
     else if(IS_LIST(receiver)){
-        ObjList* list = AS_LIST(receiver);
         Value method;
-        if(tableGet(&list->nativeMethods, name, &method)){
-            vm.stackTop[-argCount-1] = method;
+        if(tableGet(&vm.listMethods, name, &method)){
             return callNativeObjMethod(receiver, method, argCount);
         } else {
             runtimeError("List method '%s' not found.", name->chars);
@@ -835,16 +1454,34 @@ bool invoke(ObjString* name, int argCount){
     }
     // File method call
     else if(IS_FILE(receiver)){
-        ObjFile* file = AS_FILE(receiver);
         Value method;
-        if(tableGet(&file->nativeMethods, name, &method)){
-            vm.stackTop[-argCount-1] = method;
+        if(tableGet(&vm.fileMethods, name, &method)){
             return callNativeObjMethod(receiver, method, argCount);
         } else {
             runtimeError("File method '%s' not found.", name->chars);
             return false;
         }
     }
+    // String builder method call
+    else if(IS_BUILDER(receiver)){
+        Value method;
+        if(tableGet(&vm.builderMethods, name, &method)){
+            return callNativeObjMethod(receiver, method, argCount);
+        } else {
+            runtimeError("Builder method '%s' not found.", name->chars);
+            return false;
+        }
+    }
+    // String method call
+    else if(IS_STRING(receiver)){
+        Value method;
+        if(tableGet(&vm.stringMethods, name, &method)){
+            return callNativeObjMethod(receiver, method, argCount);
+        } else {
+            runtimeError("String method '%s' not found.", name->chars);
+            return false;
+        }
+    }
 }
 
 int objectLength(Value object){
@@ -854,6 +1491,8 @@ int objectLength(Value object){
         return AS_LIST(object)->array.count;
     } else if(IS_MAP(object)){
         return AS_MAP(object)->count;
+    } else if(IS_BUILDER(object)){
+        return AS_BUILDER(object)->length;
     } else if(IS_INSTANCE(object)){
         // ObjInstance* instance = AS_INSTANCE(object);
         // ObjString* method = copyString("len", 3);
@@ -908,7 +1547,7 @@ bool arrayIndexExpression(Value object, Value index, Value endIndex){
     
     if(IS_STRING(object)){
         ObjString* string = AS_STRING(object);
-        ObjString* newString = copyString(string->chars + position, length);
+        ObjString* newString = copyString(stringChars(string) + position, length);
         push(OBJ_VAL(newString));
     } else if (IS_LIST(object)){
         ObjList* list = AS_LIST(object);
@@ -916,10 +1555,11 @@ bool arrayIndexExpression(Value object, Value index, Value endIndex){
         // Case 1 : more than 1 element
         if(!IS_NULL(endIndex) && end_position - position > 1){
             ObjList* new_list = newList();
-            for(int i = position; i < end_position ; i++){
-                writeValueArray(&new_list->array, list->array.values[i]);
-            }
             push(OBJ_VAL(new_list));
+            appendValueArray(
+                &new_list->array, list->array.values + position, end_position - position
+            );
+            WRITE_BARRIER(new_list);
         } else {
             // Case 2: only one element
             Value val = list->array.values[position];
@@ -989,8 +1629,8 @@ bool arraySetOperator(Value object, Value index, Value result){
     // List Object
     if(IS_LIST(object)){
         ObjList* list = AS_LIST(object);
-        Value* value = &list->array.values[object_length - position - 1];
-        *value = result;
+        list->array.values[position] = result;
+        WRITE_BARRIER(list);
     } 
 
     // String Object
@@ -1000,10 +1640,21 @@ bool arraySetOperator(Value object, Value index, Value result){
             return false;
         }
 
-        char* string = AS_CSTRING(object);
+        // The characters change in place, so an interned string leaves the
+        // table before it stops matching its entry, a cached hash goes,
+        // str() stops handing it out for the number it spelled, and ropes
+        // built from it keep what it held
+        ObjString* string = AS_STRING(object);
         char* target_character = AS_CSTRING(result);
+        if(string->interned){
+            internRemove(&vm.strings, string);
+            string->interned = false;
+        }
+        string->hash = 0;
+        forgetNumberString(string);
+        if(string->inRope) unshareRopeHalf(string);
 
-        string[position] = target_character[0];
+        stringChars(string)[position] = target_character[0];
     }
     return true;
 }
@@ -4,19 +4,35 @@
 #include <stdlib.h>
 
 #include "comp.h"
+#include "intern.h"
 #include "object.h"
+#include "slab.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX ( FRAMES_MAX * UINT8_COUNT )
 
+// Extra slots reserved per frame for values pushed by runtime helpers
+// (GC protection, native results) on top of the compiled max depth
+#define STACK_HEADROOM 8
+
+// str() of an integer below this keeps the string it makes for the next call
+#define NUMBER_STRING_CACHE 1024
+
 typedef struct{
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots;
 } CallFrame;
 
+// State of the incremental collection of the whole heap
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GCPhase;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -25,26 +41,78 @@ typedef struct {
     Value* stack; // dynamically grow Stack
     Value* stackTop;
     size_t stackCapacity;
-    Table globals;  // global variables
-    Table strings;
+    // Global variables live in a dense array indexed by slot numbers the
+    // compiler resolves; globalNames maps each name to its slot. A slot
+    // holds EMPTY_VAL until the global is assigned.
+    Table globalNames;
+    ValueArray globalValues;
+    InternTable strings;
+    int internMax;   // longer strings are not interned
     Table constants; // global constants
+    // Native methods shared by all objects of a built-in type
+    Table listMethods;
+    Table fileMethods;
+    Table builderMethods;
+    Table stringMethods;
+    // Text of the integers below NUMBER_STRING_CACHE, made once needed
+    ObjString* numberStrings[NUMBER_STRING_CACHE];
     struct ObjUpvalue* openUpvalues;
-    Obj* objects;
+    // Every object lives in a slot of a page of its size class
+    SlabPage* pages[SLAB_CLASS_COUNT];
+    FreeSlot* freeSlots[SLAB_CLASS_COUNT];
+
+    // Objects allocated since the last collection
+    int youngCount;
+    int youngCapacity;
+    Obj** youngObjects;
 
     size_t bytesAllocated; // current allocated bytes in heap
+    size_t totalAllocated; // bytes allocated since the start
     size_t nextGC; // threshold to trigger GC
+    size_t youngBytes; // bytes allocated since the last collection
+    size_t nurserySize; // young bytes that trigger a minor collection
 
     /* Garbage Collector */
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
 
+    // Old objects that had references stored into them since the last
+    // collection. A minor collection traces them instead of the old heap.
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+    bool minorGC; // true while only the young generation is collected
+
+    GCPhase gcPhase;
+    SlabPage* sweepPages[SLAB_CLASS_COUNT]; // pages left to sweep
+    int unsweptPages;
+    size_t markedBytes;     // heap size when marking finished
+    size_t sweptBytes;      // bytes the sweep freed since
+    size_t liveBytes;       // what survived the last full collection
+    size_t gcStepBytes;     // bytes allocated since the last GC step
+    double gcPauseTarget;   // seconds a single GC step may take
+    double gcMaxPause;      // longest GC pause seen, in seconds
+    double gcTotalPause;    // all GC pauses so far, in seconds
+    double gcGrowFactor;    // heap growth over live bytes before a full GC
+    int gcThreads;          // threads marking and sweeping, at least 1
+    int gcPauseCount;
+    int gcFullCount;
+    int gcMinorCount;
+    int gcCompactCount;
+    bool compactPending;    // compact at the interpreter's next safepoint
+    // OP_ADD_TEMP frees the string an addition chain left on the stack as
+    // soon as it is concatenated, instead of waiting for a minor collection
+    bool freeTemporaries;
+    size_t temporariesFreed;
+    ObjString* freshString; // made by the last concatenation, if new
+
     Compiler* compiler;
 
     bool inited;
 } VM;
 
-VM vm;
+extern VM vm;
 
 typedef enum {
     INTERPRET_OK,
@@ -59,6 +127,7 @@ void resetStack();
 InterpretResult run();
 InterpretResult interpret(VM* vm, const char* source);
 
+void reserveStack(size_t needed);
 void push(Value value); 
 Value pop();
 Value peek_stack(int distance);
@@ -68,12 +137,14 @@ bool callFn(ObjClosure* closure, int argCount);
 bool callValue(Value callee, int argCount);
 
 void defineNative(const char* name, NativeFn function);
+int globalSlot(ObjString* name);
+ObjString* globalName(int slot);
 
 ObjUpvalue* captureUpvalue(Value* local);
 void closeUpvalues(Value* last);
 void defineMethod(ObjString* name);
 bool bindMethod(ObjClass* klass, ObjString* name);
-bool invoke(ObjString* name, int argCount);
+bool invoke(ObjString* name, int argCount, InlineCache* cache);
 bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
 bool handleIndexOperator(Value, Value,Value);
 bool handleIndexSetOperator(Value object, Value index, Value result);
@@ -0,0 +1,433 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "slab.h"
+#include "vm.h"
+#include "workers.h"
+
+/*
+Parallel marking and sweeping. The main thread is always worker 0, the
+other workers are threads started the first time they are needed, which
+then wait for jobs until the VM is freed.
+
+Marking: every worker pushes the objects it marks on a private stack.
+When that grows and the worker's shared deque is empty, the older half of
+the stack moves there, and idle workers steal half of it at a time. Mark
+bits are set atomically, so an object is traced once. The job ends when
+every worker is idle with nothing left to steal, or at the deadline.
+
+Sweeping: workers claim whole pages in turn. What they free is collected
+per worker and handed back to the VM once the job is over. Dead interned
+strings are only gathered, they have to leave the intern table first.
+*/
+
+// Objects traced between two looks at the deadline
+#define WORKER_CHECK_INTERVAL 256
+
+// A private stack this deep hands its older half to the shared deque
+#define WORKER_PUBLISH_SIZE 64
+
+struct GCWorker {
+    pthread_t thread;
+
+    Obj** stack;
+    int count;
+    int capacity;
+
+    pthread_mutex_t lock;   // guards the shared deque
+    Obj** shared;
+    int sharedTop;          // thieves take from the top,
+    int sharedCount;        // the owner from the bottom
+    int sharedCapacity;
+    atomic_int sharedSize;  // read without the lock to find work
+
+    size_t freedBytes;
+    FreeSlot* freeHeads[SLAB_CLASS_COUNT];
+    FreeSlot* freeTails[SLAB_CLASS_COUNT];
+    Obj** deadStrings;
+    int deadCount;
+    int deadCapacity;
+};
+
+typedef enum {
+    JOB_MARK,
+    JOB_SWEEP,
+} JobType;
+
+_Thread_local GCWorker* currentWorker = NULL;
+
+static GCWorker workers[GC_THREADS_MAX];
+static int workerCount = 1;
+static bool workersStarted = false;
+
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobStarted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobFinished = PTHREAD_COND_INITIALIZER;
+static int jobEpoch = 0;
+static int jobRunning = 0;
+static bool shuttingDown = false;
+
+static JobType jobType;
+static double jobDeadline;
+static atomic_bool jobStopped;
+static atomic_int idleWorkers;
+
+// Size class of the next page to sweep, guarded by jobLock along with
+// vm.sweepPages and vm.unsweptPages
+static int nextClass;
+
+static void pushObject(Obj*** items, int* count, int* capacity, Obj* object){
+    if(*capacity < *count + 1){
+        *capacity = GROW_CAPACITY(*capacity);
+        *items = (Obj**)realloc(*items, sizeof(Obj*) * *capacity);
+
+        // Unable to allocate more memory for a worker
+        if(*items == NULL) exit(1);
+    }
+    (*items)[(*count)++] = object;
+}
+
+static bool jobOver(){
+    if(jobDeadline > 0 && gcClock() >= jobDeadline){
+        atomic_store(&jobStopped, true);
+    }
+    return atomic_load(&jobStopped);
+}
+
+/* Marking */
+
+void workerMark(Obj* object){
+    uint64_t mask = SLAB_MARK_MASK(object);
+    uint64_t old = __atomic_fetch_or(
+        &SLAB_MARK_WORD(object), mask, __ATOMIC_RELAXED
+    );
+    if(old & mask) return;
+
+    GCWorker* worker = currentWorker;
+    pushObject(&worker->stack, &worker->count, &worker->capacity, object);
+}
+
+static void publish(GCWorker* worker){
+    if(worker->count < WORKER_PUBLISH_SIZE * 2) return;
+    if(atomic_load_explicit(&worker->sharedSize, memory_order_relaxed) > 0){
+        return;
+    }
+
+    int moved = worker->count / 2;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->sharedTop = 0;
+    worker->sharedCount = 0;
+    for(int i = 0; i < moved; i++){
+        pushObject(&worker->shared, &worker->sharedCount,
+            &worker->sharedCapacity, worker->stack[i]);
+    }
+    atomic_store(&worker->sharedSize, moved);
+    pthread_mutex_unlock(&worker->lock);
+
+    worker->count -= moved;
+    memmove(worker->stack, worker->stack + moved,
+        sizeof(Obj*) * worker->count);
+}
+
+static bool popGray(GCWorker* worker, Obj** object){
+    if(worker->count > 0){
+        *object = worker->stack[--worker->count];
+        return true;
+    }
+    if(atomic_load_explicit(&worker->sharedSize, memory_order_relaxed) == 0){
+        return false;
+    }
+
+    bool found = false;
+    pthread_mutex_lock(&worker->lock);
+    if(worker->sharedCount > worker->sharedTop){
+        *object = worker->shared[--worker->sharedCount];
+        atomic_store(&worker->sharedSize,
+            worker->sharedCount - worker->sharedTop);
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static bool steal(GCWorker* thief){
+    int self = (int)(thief - workers);
+
+    for(int i = 1; i < workerCount; i++){
+        GCWorker* victim = &workers[(self + i) % workerCount];
+        if(atomic_load(&victim->sharedSize) == 0) continue;
+
+        pthread_mutex_lock(&victim->lock);
+        int available = victim->sharedCount - victim->sharedTop;
+        int taken = (available + 1) / 2;
+        for(int j = 0; j < taken; j++){
+            pushObject(&thief->stack, &thief->count, &thief->capacity,
+                victim->shared[victim->sharedTop++]);
+        }
+        atomic_store(&victim->sharedSize, available - taken);
+        pthread_mutex_unlock(&victim->lock);
+
+        if(taken > 0) return true;
+    }
+    return false;
+}
+
+static bool anyShared(){
+    for(int i = 0; i < workerCount; i++){
+        if(atomic_load(&workers[i].sharedSize) > 0) return true;
+    }
+    return false;
+}
+
+static void markLoop(GCWorker* worker){
+    int traced = 0;
+
+    for(;;){
+        Obj* object;
+        while(popGray(worker, &object)){
+            blackendObject(object);
+            publish(worker);
+            if(++traced % WORKER_CHECK_INTERVAL == 0 && jobOver()) return;
+        }
+
+        if(steal(worker)) continue;
+
+        // Done once every worker is idle, none of them can make work then
+        atomic_fetch_add(&idleWorkers, 1);
+        for(;;){
+            if(atomic_load(&idleWorkers) == workerCount) return;
+            if(jobOver()) return;
+            if(anyShared()){
+                atomic_fetch_sub(&idleWorkers, 1);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+/* Sweeping */
+
+void workerFreeBytes(size_t size){
+    currentWorker->freedBytes += size;
+}
+
+void workerFreeSlot(Obj* object, size_t size){
+    GCWorker* worker = currentWorker;
+    FreeSlot* slot = (FreeSlot*)object;
+    int sizeClass = SLAB_CLASS(size);
+
+    worker->freedBytes += size;
+    slot->obj.isFree = true;
+    slot->next = worker->freeHeads[sizeClass];
+    if(slot->next == NULL) worker->freeTails[sizeClass] = slot;
+    worker->freeHeads[sizeClass] = slot;
+    // Pages are swept by a single worker
+    SLAB_PAGE(slot)->usedSlots--;
+}
+
+static void sweepLoop(GCWorker* worker){
+    for(;;){
+        pthread_mutex_lock(&jobLock);
+        while(nextClass < SLAB_CLASS_COUNT
+                && vm.sweepPages[nextClass] == NULL){
+            nextClass++;
+        }
+        SlabPage* page = NULL;
+        if(nextClass < SLAB_CLASS_COUNT){
+            page = vm.sweepPages[nextClass];
+            vm.sweepPages[nextClass] = page->next;
+            vm.unsweptPages--;
+        }
+        pthread_mutex_unlock(&jobLock);
+
+        if(page == NULL) return;
+
+        for(int i = 0; i < page->slotCount; i++){
+            Obj* object = SLAB_SLOT(page, i);
+            if(object->isFree || !object->isOld || IS_MARKED(object)){
+                continue;
+            }
+
+            if(object->type == OBJ_STRING && ((ObjString*)object)->interned){
+                pushObject(&worker->deadStrings, &worker->deadCount,
+                    &worker->deadCapacity, object);
+            } else {
+                freeObject(object);
+            }
+        }
+        memset(page->marks, 0, sizeof(page->marks));
+        page->swept = true;
+
+        if(jobOver()) return;
+    }
+}
+
+/* Jobs */
+
+static void runJob(GCWorker* worker){
+    if(jobType == JOB_MARK){
+        markLoop(worker);
+    } else {
+        sweepLoop(worker);
+    }
+}
+
+static void* workerMain(void* arg){
+    GCWorker* worker = (GCWorker*)arg;
+    currentWorker = worker;
+    int seen = 0;
+
+    pthread_mutex_lock(&jobLock);
+    for(;;){
+        while(jobEpoch == seen && !shuttingDown){
+            pthread_cond_wait(&jobStarted, &jobLock);
+        }
+        if(shuttingDown) break;
+        seen = jobEpoch;
+        pthread_mutex_unlock(&jobLock);
+
+        runJob(worker);
+
+        pthread_mutex_lock(&jobLock);
+        if(--jobRunning == 0) pthread_cond_signal(&jobFinished);
+    }
+    pthread_mutex_unlock(&jobLock);
+    return NULL;
+}
+
+static void startWorkers(){
+    if(workersStarted) return;
+    workersStarted = true;
+
+    pthread_mutex_init(&workers[0].lock, NULL);
+
+    while(workerCount < vm.gcThreads){
+        GCWorker* worker = &workers[workerCount];
+        pthread_mutex_init(&worker->lock, NULL);
+        // Without more threads the collection still runs on the main one
+        if(pthread_create(&worker->thread, NULL, workerMain, worker) != 0){
+            pthread_mutex_destroy(&worker->lock);
+            vm.gcThreads = workerCount;
+            break;
+        }
+        workerCount++;
+    }
+}
+
+static void runParallel(JobType type, double deadline){
+    startWorkers();
+
+    jobType = type;
+    jobDeadline = deadline;
+    atomic_store(&jobStopped, false);
+    atomic_store(&idleWorkers, 0);
+
+    pthread_mutex_lock(&jobLock);
+    jobEpoch++;
+    jobRunning = workerCount - 1;
+    pthread_cond_broadcast(&jobStarted);
+    pthread_mutex_unlock(&jobLock);
+
+    currentWorker = &workers[0];
+    runJob(&workers[0]);
+    currentWorker = NULL;
+
+    pthread_mutex_lock(&jobLock);
+    while(jobRunning > 0){
+        pthread_cond_wait(&jobFinished, &jobLock);
+    }
+    pthread_mutex_unlock(&jobLock);
+}
+
+// Traces the gray stack until it is empty, which is returned, or until
+// the deadline if there is one. What is left goes back on the gray stack.
+bool parallelTrace(double deadline){
+    GCWorker* first = &workers[0];
+    for(int i = 0; i < vm.grayCount; i++){
+        pushObject(&first->shared, &first->sharedCount,
+            &first->sharedCapacity, vm.grayStack[i]);
+    }
+    atomic_store(&first->sharedSize, first->sharedCount);
+    vm.grayCount = 0;
+
+    runParallel(JOB_MARK, deadline);
+
+    for(int i = 0; i < workerCount; i++){
+        GCWorker* worker = &workers[i];
+        for(int j = 0; j < worker->count; j++){
+            pushObject(&vm.grayStack, &vm.grayCount, &vm.grayCapacity,
+                worker->stack[j]);
+        }
+        for(int j = worker->sharedTop; j < worker->sharedCount; j++){
+            pushObject(&vm.grayStack, &vm.grayCount, &vm.grayCapacity,
+                worker->shared[j]);
+        }
+        worker->count = 0;
+        worker->sharedTop = 0;
+        worker->sharedCount = 0;
+        atomic_store(&worker->sharedSize, 0);
+    }
+
+    return vm.grayCount == 0;
+}
+
+// Sweeps old objects page by page until none is left, which is returned,
+// or until the deadline if there is one
+bool parallelSweep(double deadline){
+    size_t before = vm.bytesAllocated;
+    nextClass = 0;
+
+    runParallel(JOB_SWEEP, deadline);
+
+    for(int i = 0; i < workerCount; i++){
+        GCWorker* worker = &workers[i];
+
+        vm.bytesAllocated -= worker->freedBytes;
+        worker->freedBytes = 0;
+
+        for(int j = 0; j < SLAB_CLASS_COUNT; j++){
+            if(worker->freeHeads[j] == NULL) continue;
+            worker->freeTails[j]->next = vm.freeSlots[j];
+            vm.freeSlots[j] = worker->freeHeads[j];
+            worker->freeHeads[j] = NULL;
+            worker->freeTails[j] = NULL;
+        }
+
+        for(int j = 0; j < worker->deadCount; j++){
+            ObjString* string = (ObjString*)worker->deadStrings[j];
+            internRemove(&vm.strings, string);
+            freeObject((Obj*)string);
+        }
+        worker->deadCount = 0;
+    }
+    vm.sweptBytes += before - vm.bytesAllocated;
+
+    return vm.unsweptPages == 0;
+}
+
+void freeWorkers(){
+    if(!workersStarted) return;
+
+    pthread_mutex_lock(&jobLock);
+    shuttingDown = true;
+    pthread_cond_broadcast(&jobStarted);
+    pthread_mutex_unlock(&jobLock);
+
+    for(int i = 0; i < workerCount; i++){
+        GCWorker* worker = &workers[i];
+        if(i > 0) pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->lock);
+        free(worker->stack);
+        free(worker->shared);
+        free(worker->deadStrings);
+    }
+    workerCount = 1;
+    workersStarted = false;
+    shuttingDown = false;
+}
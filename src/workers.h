@@ -0,0 +1,20 @@
+#ifndef viper_workers_h
+#define viper_workers_h
+
+#include "common.h"
+#include "object.h"
+
+typedef struct GCWorker GCWorker;
+
+// The worker run by the current thread, NULL outside parallel work
+extern _Thread_local GCWorker* currentWorker;
+
+void workerMark(Obj* object);
+void workerFreeBytes(size_t size);
+void workerFreeSlot(Obj* object, size_t size);
+
+bool parallelTrace(double deadline);
+bool parallelSweep(double deadline);
+void freeWorkers();
+
+#endif